@@ -13,7 +13,7 @@ using geometry::line2f;
 GlobalPlanner::GlobalPlanner(){
 	// Initialize blueprint map
 	map_.Load("maps/GDC1.txt");
-	cout << "Initialized GDC1 map with " << map_.lines.size() << " lines." << endl;
+	cout << "Initialized GDC1 map with " << map_.lines().size() << " lines." << endl;
 }
 
 void GlobalPlanner::setResolution(float resolution){
@@ -71,14 +71,10 @@ bool GlobalPlanner::isValidNeighbor(const Node &node, const Neighbor &neighbor){
 	auto cushion_lines = getCushionLines(edge, 0.5);
 
 	// Check for collisions
-	for (const line2f map_line : map_.lines)
-    {
-		bool intersection = map_line.Intersects(edge);
-		for (const line2f bounding_box_edge : cushion_lines){
-			intersection = intersection or map_line.Intersects(bounding_box_edge);
-		}
-		if (intersection) return false;
-    }
+	if (map_.Intersects(edge.p0, edge.p1)) return false;
+	for (const line2f &bounding_box_edge : cushion_lines){
+		if (map_.Intersects(bounding_box_edge.p0, bounding_box_edge.p1)) return false;
+	}
 
 	return true;
 }
@@ -220,7 +216,7 @@ float GlobalPlanner::getSocialCost(Node &new_node){
 		if ( H->isHidden(new_node.loc, map_) ){
 			// Line of sight from human to node
 			const line2f view_line(H->getLoc(), new_node.loc);
-			for (const line2f map_line : map_.lines){
+			for (const line2f map_line : map_.lines()){
 				Vector2f intersection_point;
 				bool intersects = map_line.Intersection(view_line, &intersection_point);
 				if (intersects){
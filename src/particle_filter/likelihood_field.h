@@ -0,0 +1,87 @@
+//========================================================================
+//  This software is free: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License Version 3,
+//  as published by the Free Software Foundation.
+//
+//  This software is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  Version 3 in the file COPYING that came with this distribution.
+//  If not, see <http://www.gnu.org/licenses/>.
+//========================================================================
+/*!
+\file    likelihood_field.h
+\brief   Distance-to-nearest-wall raster of a vector map, for the
+         likelihood field observation model.
+*/
+//========================================================================
+
+#include <string>
+#include <vector>
+
+#include "eigen3/Eigen/Dense"
+#include "vector_map/vector_map.h"
+
+#ifndef SRC_PARTICLE_FILTER_LIKELIHOOD_FIELD_H_
+#define SRC_PARTICLE_FILTER_LIKELIHOOD_FIELD_H_
+
+namespace particle_filter {
+
+class LikelihoodField {
+ public:
+  LikelihoodField();
+
+  // Rasterize the map at the given cell size (meters), storing the distance
+  // to the nearest map line for every cell, saturated at max_distance.
+  void Build(const vector_map::VectorMap& map,
+             float resolution,
+             float max_distance);
+
+  // Distance from a point (map frame) to the nearest map line, saturated at
+  // max_distance. Points outside of the raster return max_distance.
+  float Distance(const Eigen::Vector2f& p) const {
+    const int xi = static_cast<int>((p.x() - origin_.x()) * inv_resolution_);
+    const int yi = static_cast<int>((p.y() - origin_.y()) * inv_resolution_);
+    if (p.x() < origin_.x() || p.y() < origin_.y() ||
+        xi >= width_ || yi >= height_) {
+      return max_distance_;
+    }
+    return distance_[yi * width_ + xi];
+  }
+
+  // Batch version of Distance, for points stored as separate x and y arrays,
+  // writing into an array of the same size.
+  void Distances(const Eigen::Ref<const Eigen::ArrayXf>& x,
+                 const Eigen::Ref<const Eigen::ArrayXf>& y,
+                 Eigen::Ref<Eigen::ArrayXf> distances) const;
+
+  // True if the field has been built for the named map at this resolution.
+  bool IsBuiltFor(const std::string& map_file, float resolution) const {
+    return !distance_.empty() && map_file == map_file_ &&
+        resolution == resolution_;
+  }
+
+  float GetResolution() const { return resolution_; }
+  float GetMaxDistance() const { return max_distance_; }
+
+ private:
+  // Map that this field was built from.
+  std::string map_file_;
+  // Location of the lower left corner of cell (0, 0).
+  Eigen::Vector2f origin_;
+  float resolution_;
+  float inv_resolution_;
+  float max_distance_;
+  // Number of cells along x and y.
+  int width_;
+  int height_;
+  // Row-major distances, in meters.
+  std::vector<float> distance_;
+};
+
+}  // namespace particle_filter
+
+#endif  // SRC_PARTICLE_FILTER_LIKELIHOOD_FIELD_H_
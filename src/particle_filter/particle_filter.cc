@@ -40,6 +40,7 @@
 using math_util::DegToRad;
 using math_util::RadToDeg;
 using math_util::AngleDiff;
+using math_util::AngleMod;
 using geometry::line2f;
 using std::cout;
 using std::endl;
@@ -51,24 +52,99 @@ using Eigen::Vector2i;
 using vector_map::VectorMap;
 
 DEFINE_double(num_particles, 50, "Number of particles");
+DEFINE_int32(beam_stride, 10, "Use every n-th laser beam to weight particles");
+DEFINE_bool(likelihood_field,
+            false,
+            "Weight particles with a precomputed likelihood field instead of "
+            "ray casting the map");
+DEFINE_double(likelihood_field_resolution,
+              0.05,
+              "Cell size of the likelihood field (meters)");
+DEFINE_bool(range_table,
+            false,
+            "Look up expected ranges in the precomputed maps/<map>.ranges "
+            "table (see range_table_main.cc) instead of ray casting");
+DEFINE_bool(batch_update,
+            false,
+            "Score all particles beam by beam with vectorized arrays "
+            "(requires --likelihood_field)");
+DEFINE_double(resample_ess_fraction,
+              0.5,
+              "Resample when the effective sample size falls below this "
+              "fraction of the number of particles");
+DEFINE_bool(kld_sampling,
+            false,
+            "Adapt the number of particles to the spread of the belief "
+            "(KLD-sampling) instead of keeping num_particles");
+DEFINE_int32(kld_min_particles, 20, "Minimum number of particles with KLD-sampling");
+DEFINE_int32(kld_max_particles, 2000, "Maximum number of particles with KLD-sampling");
+DEFINE_double(kld_shrink_ratio,
+              2,
+              "With KLD-sampling, also resample when the particle set is this "
+              "many times larger than the belief requires, even if the "
+              "weights have not degenerated");
+DEFINE_double(kld_epsilon, 0.05, "Bound on the KL divergence of KLD-sampling");
+DEFINE_double(kld_z,
+              2.33,
+              "Upper 1 - delta quantile of the standard normal distribution "
+              "for KLD-sampling (2.33 for delta = 0.01)");
+DEFINE_double(kld_bin_size_xy, 0.2, "KLD-sampling histogram bin size (meters)");
+DEFINE_double(kld_bin_size_angle, 0.17, "KLD-sampling histogram bin size (radians)");
+DEFINE_int32(num_threads,
+             1,
+             "Number of threads to update particles with. Results are "
+             "deterministic for a given seed and number of threads");
+DEFINE_int32(random_seed, 1, "Seed of the per-thread motion model noise");
 
 namespace {
-  int updates_since_last_resample_ = 0;
   Vector2f last_update_loc_(0,0);
   Vector2f last_resample_loc_(0,0);
+  // Empty slot of the KLD bin hash set
+  const uint64_t kEmptyKLDBin = ~0ull;
 } // namespace
 
 namespace particle_filter {
 
 config_reader::ConfigReader config_reader_({"config/particle_filter.lua"});
 
+void ParticleArrays::Pack(const vector<Particle>& particles) {
+  size = particles.size();
+  const size_t padded_size = (size + kPadding - 1) / kPadding * kPadding;
+  // Only reallocates when the number of particles changes.
+  if (static_cast<size_t>(x.size()) != padded_size) {
+    for (Eigen::ArrayXf* a : {&x, &y, &angle, &cos_angle, &sin_angle, &lidar_x,
+                              &lidar_y, &end_x, &end_y, &distance, &sq_error_sum}) {
+      a->resize(padded_size);
+    }
+    log_weight.resize(padded_size);
+  }
+  // Padding particles are harmless, their weights are never read back.
+  x.tail(padded_size - size).setZero();
+  y.tail(padded_size - size).setZero();
+  angle.tail(padded_size - size).setZero();
+  log_weight.tail(padded_size - size).setZero();
+  for (size_t i = 0; i < size; i++) {
+    x(i) = particles[i].loc.x();
+    y(i) = particles[i].loc.y();
+    angle(i) = particles[i].angle;
+    log_weight(i) = particles[i].log_weight;
+  }
+}
+
+void ParticleArrays::UnpackWeights(vector<Particle>* particles) const {
+  for (size_t i = 0; i < size; i++) {
+    (*particles)[i].log_weight = log_weight(i);
+  }
+}
+
 ParticleFilter::ParticleFilter() :
     prev_odom_loc_(0, 0),
     prev_odom_angle_(0),
     odom_initialized_(false),
     var_obs_(1.0), // variance of lidar
     d_short_(0.5), // was 0.1
-    d_long_(0.5){} // was 0.3
+    d_long_(0.5), // was 0.3
+    pose_estimate_(PoseEstimate::Zero()) {}
 
 void ParticleFilter::GetParticles(vector<Particle>* particles) const {
   *particles = particles_;
@@ -86,7 +162,7 @@ void ParticleFilter::GetPredictedPointCloud(const Vector2f& loc,
   vector<Vector2f>& scan = *scan_ptr;
 
   // Note: The returned values must be set using the `scan` variable:
-  scan.resize(num_ranges/10);
+  scan.resize(num_ranges/FLAGS_beam_stride);
 
   Vector2f lidar_loc = loc + 0.2*Vector2f( cos(angle), sin(angle) );
   
@@ -95,31 +171,30 @@ void ParticleFilter::GetPredictedPointCloud(const Vector2f& loc,
   {
     // Get the visual "ray" vector for this particular scan
     line2f ray_line(1,2,3,4); // Line segment from (1,2) to (3,4)
-    float ray_angle = angle + 10.0*i_scan/num_ranges*(angle_max-angle_min) + angle_min;
+    float ray_angle = angle + float(FLAGS_beam_stride)*i_scan/num_ranges*(angle_max-angle_min) + angle_min;
     ray_line.p0.x() = lidar_loc.x() + range_min*cos(ray_angle);
     ray_line.p0.y() = lidar_loc.y() + range_min*sin(ray_angle);
     ray_line.p1.x() = lidar_loc.x() + range_max*cos(ray_angle);
     ray_line.p1.y() = lidar_loc.y() + range_max*sin(ray_angle);
+
+    // Precomputed range along this ray, if available
+    if (range_table_.IsLoaded())
+    {
+      const float range = std::min(range_max, range_table_.Range(lidar_loc, ray_angle));
+      scan[i_scan] = lidar_loc + range * Vector2f( cos(ray_angle), sin(ray_angle) );
+      continue;
+    }
     
     // Initialize variables for next loop
     Vector2f intersection_min = lidar_loc + range_max * Vector2f( cos(ray_angle), sin(ray_angle) );
     float dist_to_intersection_min = range_max;
-    // Sweep through lines in map to get the closest intersection with laser ray
-    for (const line2f map_line : map_.lines)
+    // Closest intersection of the laser ray with the map, using the map's
+    // spatial index to only test lines near the ray
+    Vector2f intersection_point;
+    if (map_.Intersection(ray_line.p0, ray_line.p1, &intersection_point) and
+        (intersection_point-loc).norm() < dist_to_intersection_min)
     {
-      Vector2f intersection_point;
-      bool intersects = map_line.Intersection(ray_line, &intersection_point);
-      // If there is an intersection, examine this point
-      if (intersects)
-      {
-        float dist_to_this_intersection = (intersection_point-loc).norm();
-        // If it's the closest point yet, record it
-        if (dist_to_this_intersection < dist_to_intersection_min)
-        {
-          dist_to_intersection_min = dist_to_this_intersection;
-          intersection_min = intersection_point;
-        }
-      }
+      intersection_min = intersection_point;
     }
 
     // Return closest point for this particular scan (map frame)
@@ -138,6 +213,13 @@ void ParticleFilter::Update(const vector<float>& ranges,
 
   if (not odom_initialized_) return;
 
+  if (FLAGS_likelihood_field) {
+    particle.log_weight += LikelihoodFieldLogLikelihood(
+        ranges, range_min, range_max, angle_min, angle_max,
+        particle.loc, particle.angle);
+    return;
+  }
+
   // Get predicted point cloud
   vector<Vector2f> predicted_cloud;
   GetPredictedPointCloud(particle.loc, particle.angle,
@@ -174,41 +256,229 @@ void ParticleFilter::Update(const vector<float>& ranges,
   particle.log_weight += log_error_sum; //gamma is 1
 }
 
-// Resample particles to duplicate good ones and get rid of bad ones
+// Same observation model as Update, but the predicted range along each beam is
+// replaced by the distance from the observed end point to the nearest wall,
+// which is a single lookup instead of a ray cast against every map line.
+float ParticleFilter::LikelihoodFieldLogLikelihood(const vector<float>& ranges,
+                                                   float range_min,
+                                                   float range_max,
+                                                   float angle_min,
+                                                   float angle_max,
+                                                   const Vector2f& loc,
+                                                   const float angle) const {
+  const Vector2f lidar_loc = loc + 0.2*Vector2f( cos(angle), sin(angle) );
+  const float angle_increment = (angle_max - angle_min) / ranges.size();
+  float log_error_sum = 0;
+  for (size_t i = 0; i < ranges.size(); i += FLAGS_beam_stride)
+  {
+    // Discount any erronious readings at or exceeding the limits of the lidar range
+    if (ranges[i] > 0.95*range_max  or ranges[i] <  1.05*range_min) continue;
+
+    const float ray_angle = angle + angle_min + i*angle_increment;
+    const Vector2f end_point = lidar_loc + ranges[i]*Vector2f( cos(ray_angle), sin(ray_angle) );
+    const float dist = std::min(likelihood_field_.Distance(end_point), d_long_);
+    log_error_sum += -Sq(dist) / var_obs_;
+  }
+  return log_error_sum;
+}
+
+// Vectorized equivalent of calling Update with the likelihood field on each of
+// particles [begin, end): the loops are swapped, so that every beam is scored
+// against all particles at once.
+void ParticleFilter::BatchUpdate(const vector<float>& ranges,
+                                 float range_min,
+                                 float range_max,
+                                 float angle_min,
+                                 float angle_max,
+                                 size_t begin,
+                                 size_t end) {
+  if (not odom_initialized_ or end <= begin) return;
+  const int n = end - begin;
+
+  // Heading terms are computed once per particle instead of once per beam.
+  // Each worker only touches its own segment of the scratch arrays.
+  ParticleArrays& arrays = particle_arrays_;
+  auto cos_angle = arrays.cos_angle.segment(begin, n);
+  auto sin_angle = arrays.sin_angle.segment(begin, n);
+  auto lidar_x = arrays.lidar_x.segment(begin, n);
+  auto lidar_y = arrays.lidar_y.segment(begin, n);
+  auto end_x = arrays.end_x.segment(begin, n);
+  auto end_y = arrays.end_y.segment(begin, n);
+  auto dist = arrays.distance.segment(begin, n);
+  auto sq_error_sum = arrays.sq_error_sum.segment(begin, n);
+  cos_angle = arrays.angle.segment(begin, n).cos();
+  sin_angle = arrays.angle.segment(begin, n).sin();
+  lidar_x = arrays.x.segment(begin, n) + 0.2*cos_angle;
+  lidar_y = arrays.y.segment(begin, n) + 0.2*sin_angle;
+  sq_error_sum.setZero();
+
+  const float angle_increment = (angle_max - angle_min) / ranges.size();
+  for (size_t i = 0; i < ranges.size(); i += FLAGS_beam_stride)
+  {
+    // Discount any erronious readings at or exceeding the limits of the lidar range
+    if (ranges[i] > 0.95*range_max  or ranges[i] <  1.05*range_min) continue;
+
+    // Beam end point in the lidar frame, rotated by every particle's heading
+    const float beam_angle = angle_min + i*angle_increment;
+    const float beam_x = ranges[i]*cos(beam_angle);
+    const float beam_y = ranges[i]*sin(beam_angle);
+    end_x = lidar_x + beam_x*cos_angle - beam_y*sin_angle;
+    end_y = lidar_y + beam_x*sin_angle + beam_y*cos_angle;
+    likelihood_field_.Distances(end_x, end_y, dist);
+    sq_error_sum += dist.min(d_long_).square();
+  }
+  arrays.log_weight.segment(begin, n) -= (sq_error_sum / var_obs_).cast<double>();
+}
+
+// Normalize the particle weights so that they sum to one, using log-sum-exp
+// in double precision, and return the effective sample size. Also fills in
+// the linear weights used by the pose estimate and the cumulative weights
+// used by the resamplers.
+double ParticleFilter::NormalizeWeights()
+{
+  const size_t num_particles = particles_.size();
+  weight_breakpoints_.resize(num_particles);
+  weights_.resize(num_particles);
+  if (num_particles == 0) return 0;
+
+  double max_log_weight = -std::numeric_limits<double>::infinity();
+  for (const Particle &particle : particles_)
+    max_log_weight = std::max(max_log_weight, particle.log_weight);
+  // Corresponds to all particles having zero weight
+  if (not std::isfinite(max_log_weight)){
+    std::fill(weights_.begin(), weights_.end(), 1.0 / num_particles);
+    return 0;
+  }
+
+  double weight_sum = 0;
+  double sq_weight_sum = 0;
+  for (size_t i=0; i < num_particles; i++){
+    const double weight = exp(particles_[i].log_weight - max_log_weight);
+    weights_[i] = weight;
+    weight_sum += weight;
+    sq_weight_sum += weight * weight;
+    weight_breakpoints_[i] = weight_sum;
+  }
+  for (double &breakpoint : weight_breakpoints_) breakpoint /= weight_sum;
+  for (double &weight : weights_) weight /= weight_sum;
+  weight_breakpoints_.back() = 1.0;
+
+  const double log_weight_sum = max_log_weight + log(weight_sum);
+  for (Particle &particle : particles_) particle.log_weight -= log_weight_sum;
+
+  return weight_sum * weight_sum / sq_weight_sum;
+}
+
+// Resample particles to duplicate good ones and get rid of bad ones, with a
+// low-variance (systematic) resampler. New particles are written to a
+// preallocated buffer that is then swapped with particles_, so resampling
+// does not allocate once the buffers have grown to the largest particle set.
+// Expects the weights to have been normalized by NormalizeWeights.
 void ParticleFilter::Resample() 
 {
   // Check whether particles have been initialized
   if (particles_.empty() or not odom_initialized_) return;
 
-  // Initialize Local Variables (static for speed in exchange for memory)
-  vector<Particle> new_particles;                                         // temp variable to house new particles
-  static vector<float> absolute_weight_breakpoints(FLAGS_num_particles);  // vector of cumulative absolute normalized weights
-  float normalized_sum = 0;                                               // sum of normalized (but NOT log) weights: used for resampling
-
-  // Normalize each of the log weights
-  for (size_t i=0; i < FLAGS_num_particles; i++){
-    particles_[i].log_weight -= max_log_particle_weight_;
-    normalized_sum += exp(particles_[i].log_weight);
-    absolute_weight_breakpoints[i] = normalized_sum;
+  if (FLAGS_kld_sampling){
+    KLDResample();
+  } else {
+    const size_t num_particles = particles_.size();
+    const double division_size = 1.0 / num_particles;                     // spacing of test points in the cumulative sum
+    double sample_point = rng_.UniformRandom(0, division_size);           // initial test point
+    resample_buffer_.resize(num_particles);
+    size_t i = 0;
+    for (size_t m=0; m < num_particles; m++){
+      while (weight_breakpoints_[i] < sample_point and i + 1 < num_particles) i++;
+      resample_buffer_[m] = particles_[i];
+      sample_point += division_size;
+    }
   }
+  UseResampledParticles();
+}
 
-  float division_size = normalized_sum / FLAGS_num_particles;             // spacing of test points in the cumulative sum
-  float sample_point = rng_.UniformRandom(0,division_size);               // initial test point
+// With KLD-sampling, resample a converged belief down to the number of
+// particles it needs. Weights that stay even enough never trigger Resample,
+// and the set would otherwise keep the size it was initialized with. The
+// drawn set is only kept when it is much smaller, so that a set of the right
+// size is not resampled on every update. Returns whether it resampled.
+bool ParticleFilter::ShrinkParticles()
+{
+  if (not FLAGS_kld_sampling or particles_.empty() or not odom_initialized_) return false;
+  const double min_particles = std::max(1, FLAGS_kld_min_particles);
+  if (particles_.size() < FLAGS_kld_shrink_ratio * min_particles) return false;
+
+  KLDResample();
+  if (FLAGS_kld_shrink_ratio * resample_buffer_.size() > particles_.size()) return false;
+  UseResampledParticles();
+  return true;
+}
 
-  // Corresponds to all particles having zero weight
-  if (division_size == 0) return;
+// Replace the particles with the ones drawn into resample_buffer_.
+void ParticleFilter::UseResampledParticles()
+{
+  particles_.swap(resample_buffer_);
 
-  // Resample based on the absolute weights
-  for (size_t i=0; i < FLAGS_num_particles; i++){
-    while (absolute_weight_breakpoints[i] > sample_point){
-      new_particles.push_back(particles_[i]);
-      sample_point += division_size;
+  // Resampled particles are equally likely
+  for (Particle &particle : particles_) particle.log_weight = 0;
+  weights_.assign(particles_.size(), 1.0 / particles_.size());
+  UpdatePoseEstimate();
+}
+
+// KLD-sampling (Fox, 2003): draw particles until enough have been drawn to
+// bound the KL divergence between the sampled and true belief, given the
+// number of histogram bins that the samples occupy. A spread out belief
+// occupies many bins and gets many particles, a converged one few. Writes to
+// resample_buffer_, and expects normalized weight_breakpoints_.
+void ParticleFilter::KLDResample()
+{
+  const size_t min_particles = std::max(1, FLAGS_kld_min_particles);
+  const size_t max_particles = std::max(FLAGS_kld_max_particles, FLAGS_kld_min_particles);
+  size_t num_required = min_particles;
+  size_t num_occupied_bins = 0;
+
+  // Open addressing hash set of occupied bins, reused between calls.
+  size_t table_size = 1;
+  while (table_size < 2 * max_particles) table_size *= 2;
+  kld_bins_.assign(table_size, kEmptyKLDBin);
+
+  resample_buffer_.clear();
+  while (resample_buffer_.size() < num_required and
+         resample_buffer_.size() < max_particles)
+  {
+    // Draw a particle in proportion to its weight
+    const double sample_point = rng_.UniformRandom();
+    const size_t i = std::min<size_t>(
+        std::upper_bound(weight_breakpoints_.begin(), weight_breakpoints_.end(), sample_point) -
+        weight_breakpoints_.begin(), weight_breakpoints_.size() - 1);
+    resample_buffer_.push_back(particles_[i]);
+
+    // Update the required number of particles when it lands in a new bin
+    const uint64_t bin = KLDBin(particles_[i]);
+    size_t slot = (bin * 0x9E3779B97F4A7C15ull) & (table_size - 1);
+    while (kld_bins_[slot] != kEmptyKLDBin and kld_bins_[slot] != bin)
+      slot = (slot + 1) & (table_size - 1);
+    if (kld_bins_[slot] == bin) continue;
+    kld_bins_[slot] = bin;
+    num_occupied_bins++;
+    if (num_occupied_bins > 1)
+    {
+      const double k = num_occupied_bins - 1;
+      const double a = 2.0 / (9.0 * k);
+      num_required = std::max<size_t>(min_particles, ceil(
+          k / (2.0 * FLAGS_kld_epsilon) * pow(1.0 - a + sqrt(a) * FLAGS_kld_z, 3)));
     }
   }
+}
 
-  // Now that all particles are normalized, the maximum log weight will be 0
-  max_log_particle_weight_ = 0;
-  particles_ = new_particles;
+// Histogram bin of a particle's pose, packed into a single key.
+uint64_t ParticleFilter::KLDBin(const Particle& particle) const
+{
+  const uint64_t kMask = (1 << 21) - 1;
+  const uint64_t xi = static_cast<int64_t>(floor(particle.loc.x() / FLAGS_kld_bin_size_xy));
+  const uint64_t yi = static_cast<int64_t>(floor(particle.loc.y() / FLAGS_kld_bin_size_xy));
+  const uint64_t ti = static_cast<int64_t>(floor(AngleMod(particle.angle) / FLAGS_kld_bin_size_angle));
+  // Keys never use the top bit, which is reserved for kEmptyKLDBin.
+  return ((xi & kMask) << 42) | ((yi & kMask) << 21) | (ti & kMask);
 }
 
 // A new laser scan observation is available (in the laser frame)
@@ -226,23 +496,42 @@ void ParticleFilter::ObserveLaser(const vector<float>& ranges,
     // Update last update location
     last_update_loc_ = prev_odom_loc_;
 
-    // Since the range of weights is (-inf,0] we have to initialize max at -inf
-    max_log_particle_weight_ = -std::numeric_limits<float>::infinity();
-
-    // Update all particle weights and find the maximum weight
-    for (auto &particle : particles_)
+    // Update all particle weights, one block of particles per worker
+    const bool batch_update = FLAGS_batch_update and FLAGS_likelihood_field;
+    if (batch_update) particle_arrays_.Pack(particles_);
+    const int num_workers = PrepareWorkers();
+#ifdef _OPENMP
+    #pragma omp parallel for num_threads(num_workers) schedule(static, 1)
+#endif
+    for (int w = 0; w < num_workers; w++)
     {
-      Update(ranges, range_min, range_max, angle_min, angle_max, &particle);
-      if (particle.log_weight > max_log_particle_weight_) max_log_particle_weight_ = particle.log_weight;
+      const size_t block_begin = WorkerBlockBegin(w, num_workers);
+      const size_t block_end = WorkerBlockBegin(w + 1, num_workers);
+      if (batch_update)
+      {
+        BatchUpdate(ranges, range_min, range_max, angle_min, angle_max,
+                    block_begin, block_end);
+        continue;
+      }
+      for (size_t i = block_begin; i < block_end; i++)
+        Update(ranges, range_min, range_max, angle_min, angle_max, &particles_[i]);
     }
-
-    // Resample every n updates
-    if (updates_since_last_resample_ > 5){
+    if (batch_update) particle_arrays_.UnpackWeights(&particles_);
+
+    // Resample once the weights have degenerated, measured by the effective
+    // sample size, or when KLD-sampling needs far fewer particles. The
+    // effective sample size is 0 when all particles have zero weight, and
+    // then there is nothing to resample from.
+    const double effective_sample_size = NormalizeWeights();
+    if (effective_sample_size > 0 and
+        effective_sample_size < FLAGS_resample_ess_fraction * particles_.size()){
       Resample();
-      updates_since_last_resample_ = 0;
       last_resample_loc_ = prev_odom_loc_;
+    } else if (effective_sample_size > 0 and ShrinkParticles()){
+      last_resample_loc_ = prev_odom_loc_;
+    } else {
+      UpdatePoseEstimate();
     }
-    else updates_since_last_resample_ ++;
   }
 }
 
@@ -260,16 +549,32 @@ void ParticleFilter::ObserveOdometry(const Vector2f& odom_loc,
     if (std::abs(angle_diff) > M_2PI)
       cout << "Error: reported change in angle exceeds 2pi" << endl;
 
-    for (auto &particle : particles_)
+    // Each worker moves its own block of particles with its own RNG stream
+    const int num_workers = PrepareWorkers();
+#ifdef _OPENMP
+    #pragma omp parallel for num_threads(num_workers) schedule(static, 1)
+#endif
+    for (int w = 0; w < num_workers; w++)
     {
-      // Find the transformation between the map and odom frame for this particle
-      Eigen::Rotation2Df R_Odom2Map(AngleDiff(particle.angle, prev_odom_angle_));
-      Vector2f map_trans_diff = R_Odom2Map * odom_trans_diff;
-      // Apply noise to pose of particle
-      UpdateParticleLocation(map_trans_diff, angle_diff, &particle);
+      const size_t block_begin = WorkerBlockBegin(w, num_workers);
+      const size_t block_end = WorkerBlockBegin(w + 1, num_workers);
+      // Draw the noise for the whole block at once, three values per particle
+      vector<float>& noise = worker_noise_[w];
+      noise.resize(3 * (block_end - block_begin));
+      worker_rngs_[w].FillGaussian(noise.data(), noise.size(), 0, 1);
+      for (size_t i = block_begin; i < block_end; i++)
+      {
+        Particle& particle = particles_[i];
+        // Find the transformation between the map and odom frame for this particle
+        Eigen::Rotation2Df R_Odom2Map(AngleDiff(particle.angle, prev_odom_angle_));
+        Vector2f map_trans_diff = R_Odom2Map * odom_trans_diff;
+        // Apply noise to pose of particle
+        UpdateParticleLocation(map_trans_diff, angle_diff, &noise[3 * (i - block_begin)], &particle);
+      }
     }
     prev_odom_loc_ = odom_loc;
     prev_odom_angle_ = odom_angle;
+    UpdatePoseEstimate();
   }
   else
   {
@@ -281,6 +586,24 @@ void ParticleFilter::ObserveOdometry(const Vector2f& odom_loc,
 
 // Update a given particle with random noise based on motion model
 void ParticleFilter::UpdateParticleLocation(Vector2f map_trans_diff, float dtheta_odom, Particle* p_ptr)
+{
+  UpdateParticleLocation(map_trans_diff, dtheta_odom, &rng_, p_ptr);
+}
+
+void ParticleFilter::UpdateParticleLocation(Vector2f map_trans_diff,
+                                            float dtheta_odom,
+                                            util_random::Random* rng_ptr,
+                                            Particle* p_ptr)
+{
+  float std_normals[3];
+  rng_ptr->FillGaussian(std_normals, 3, 0, 1);
+  UpdateParticleLocation(map_trans_diff, dtheta_odom, std_normals, p_ptr);
+}
+
+void ParticleFilter::UpdateParticleLocation(Vector2f map_trans_diff,
+                                            float dtheta_odom,
+                                            const float* std_normals,
+                                            Particle* p_ptr)
 {
   // Noise constants to tune
   const float k1 = 0.40;  // translation error per unit translation (suggested: 0.1-0.2)  was 1
@@ -292,9 +615,9 @@ void ParticleFilter::UpdateParticleLocation(Vector2f map_trans_diff, float dthet
   const float abs_angle_diff = abs(dtheta_odom);
 
   // Add noise to x, y, and theta based on movement in that dimension
-  const float translation_noise_x = rng_.Gaussian(0.0, k1*map_trans_diff.norm() + k2*abs_angle_diff);
-  const float translation_noise_y = rng_.Gaussian(0.0, k1*map_trans_diff.norm() + k2*abs_angle_diff);
-  const float rotation_noise = rng_.Gaussian(0.0, k3*map_trans_diff.norm() + k4*abs_angle_diff);
+  const float translation_noise_x = std_normals[0] * (k1*map_trans_diff.norm() + k2*abs_angle_diff);
+  const float translation_noise_y = std_normals[1] * (k1*map_trans_diff.norm() + k2*abs_angle_diff);
+  const float rotation_noise = std_normals[2] * (k3*map_trans_diff.norm() + k4*abs_angle_diff);
   particle.loc += map_trans_diff + Vector2f(translation_noise_x, translation_noise_y);
   particle.angle += dtheta_odom + rotation_noise;
 }
@@ -305,11 +628,28 @@ void ParticleFilter::Initialize(const string& map_file,
                                 const float angle) {
   particles_.clear(); // Need to get rid of particles from previous inits
   map_.Load("maps/" + map_file + ".txt");
+  if (FLAGS_likelihood_field and
+      not likelihood_field_.IsBuiltFor(map_.file_name, FLAGS_likelihood_field_resolution)) {
+    likelihood_field_.Build(map_, FLAGS_likelihood_field_resolution, std::max(d_short_, d_long_));
+  }
+  if (not FLAGS_range_table) {
+    range_table_.Unload();
+  } else {
+    const string table_file = RangeTable::TableFileForMap(map_.file_name);
+    if (range_table_.GetFile() != table_file and not range_table_.Load(table_file))
+      cout << "Unable to load range table " << table_file << ", ray casting instead." << endl;
+  }
+  if (FLAGS_batch_update and not FLAGS_likelihood_field)
+    cout << "--batch_update requires --likelihood_field, updating particles one at a time." << endl;
   odom_initialized_ = false;
   ResetOdomVariables(loc, angle);
 
-  // Make initial guesses (particles) based on a Gaussian distribution about initial placement
-  for (size_t i = 0; i < FLAGS_num_particles; i++){
+  // Make initial guesses (particles) based on a Gaussian distribution about initial placement.
+  // With KLD-sampling, start from the largest set since the belief is spread out.
+  const size_t num_particles = FLAGS_kld_sampling ? FLAGS_kld_max_particles : FLAGS_num_particles;
+  particles_.reserve(num_particles);
+  resample_buffer_.reserve(num_particles);
+  for (size_t i = 0; i < num_particles; i++){
     Particle particle_init;
     particle_init.loc.x() = rng_.Gaussian(loc.x(), 0.25);  // std_dev of 0.25m, to be tuned
     particle_init.loc.y() = rng_.Gaussian(loc.y(), 0.25);  // std_dev of 0.25m, to be tuned
@@ -317,6 +657,30 @@ void ParticleFilter::Initialize(const string& map_file,
     particle_init.log_weight = 0;
     particles_.push_back(particle_init);
   }  
+  weights_.assign(particles_.size(), 1.0 / particles_.size());
+  UpdatePoseEstimate();
+}
+
+// Create one RNG stream per worker if the number of threads changed, and
+// return the number of workers to split the particles between.
+int ParticleFilter::PrepareWorkers()
+{
+  const size_t num_workers = std::max(1, FLAGS_num_threads);
+  if (worker_rngs_.size() != num_workers)
+  {
+    worker_rngs_.clear();
+    for (size_t w = 0; w < num_workers; w++)
+      worker_rngs_.push_back(util_random::Random(FLAGS_random_seed, w));
+    worker_noise_.resize(num_workers);
+  }
+  return num_workers;
+}
+
+// First particle of a worker's block. Blocks only depend on the number of
+// particles and workers, so each particle always sees the same RNG stream.
+size_t ParticleFilter::WorkerBlockBegin(int worker, int num_workers) const
+{
+  return particles_.size() * worker / num_workers;
 }
 
 // Called when new pose is set or robot is moved substantially ("kidnapped")
@@ -325,30 +689,54 @@ void ParticleFilter::ResetOdomVariables(const Vector2f loc, const float angle) {
   last_resample_loc_ = loc;
   prev_odom_loc_ = loc;
   prev_odom_angle_ = angle;
-  updates_since_last_resample_ = 0;
+}
+
+// Weighted mean, circular mean angle and covariance of the particles,
+// published for lock-free readers. Called whenever the particles or their
+// weights change, using the normalized weights cached in weights_.
+void ParticleFilter::UpdatePoseEstimate()
+{
+  PoseEstimate estimate = PoseEstimate::Zero();
+  if (particles_.empty() or weights_.size() != particles_.size()){
+    pose_estimate_.Store(estimate);
+    return;
+  }
+
+  Eigen::Vector2d loc_sum(0, 0);
+  double cos_sum = 0;
+  double sin_sum = 0;
+  for (size_t i = 0; i < particles_.size(); i++)
+  {
+    loc_sum += weights_[i] * particles_[i].loc.cast<double>();
+    cos_sum += weights_[i] * cos(particles_[i].angle);
+    sin_sum += weights_[i] * sin(particles_[i].angle);
+  }
+  estimate.loc = loc_sum.cast<float>();
+  estimate.angle = atan2(sin_sum, cos_sum);
+
+  Eigen::Matrix3d covariance = Eigen::Matrix3d::Zero();
+  for (size_t i = 0; i < particles_.size(); i++)
+  {
+    const Vector2f dloc = particles_[i].loc - estimate.loc;
+    const Eigen::Vector3d d(dloc.x(), dloc.y(), AngleDiff(particles_[i].angle, estimate.angle));
+    covariance += weights_[i] * d * d.transpose();
+  }
+  estimate.covariance = covariance.cast<float>();
+  pose_estimate_.Store(estimate);
+}
+
+void ParticleFilter::GetPoseEstimate(PoseEstimate* estimate) const {
+  *estimate = pose_estimate_.Load();
 }
 
 // Called by OdometryCallback in particle_filter_main
 void ParticleFilter::GetLocation(Eigen::Vector2f* loc_ptr, 
                                  float* angle_ptr) const {
-  Vector2f& loc = *loc_ptr;
-  float& angle = *angle_ptr;
-
-  // Just do weighted average of loc and angle
-  Vector2f weighted_loc_sum(0.0, 0.0);
-  float weighted_angle_sum = 0.0;
-  float weight_sum = 0.0;
-  for (auto &particle : particles_)
-  {
-    // Convert from log weight to normalized weight
-    float normalized_log_weight = particle.log_weight - max_log_particle_weight_;
-    float normalized_weight = exp(normalized_log_weight);
-    weighted_loc_sum += particle.loc * normalized_weight;
-    weighted_angle_sum += particle.angle * normalized_weight;
-    weight_sum += normalized_weight;
-  }
-  loc = weighted_loc_sum / weight_sum;
-  angle = weighted_angle_sum / weight_sum;
+  // Reads the published estimate, which costs the same for any number of
+  // particles.
+  const PoseEstimate estimate = pose_estimate_.Load();
+  *loc_ptr = estimate.loc;
+  *angle_ptr = estimate.angle;
 }
 
 }  // namespace particle_filter
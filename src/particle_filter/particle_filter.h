@@ -26,9 +26,13 @@
 #include "eigen3/Eigen/Geometry"
 #include "shared/math/line2d.h"
 #include "shared/util/random.h"
+#include "shared/util/seqlock.h"
 #include "vector_map/vector_map.h"
 #include "ros/ros.h"
 
+#include "likelihood_field.h"
+#include "range_table.h"
+
 #ifndef SRC_PARTICLE_FILTER_H_
 #define SRC_PARTICLE_FILTER_H_
 
@@ -40,6 +44,48 @@ struct Particle {
   double log_weight; // changed this to log weight - Alex
 };
 
+// Structure-of-arrays copy of the particle set, so that batch updates can
+// process many particles per instruction. Eigen keeps each array aligned,
+// and the arrays are padded to a whole number of SIMD packets.
+struct ParticleArrays {
+  static const int kPadding = 16;
+  Eigen::ArrayXf x;
+  Eigen::ArrayXf y;
+  Eigen::ArrayXf angle;
+  Eigen::ArrayXd log_weight;
+  // Scratch space of BatchUpdate, one entry per particle, so that scoring a
+  // scan does not allocate.
+  Eigen::ArrayXf cos_angle;
+  Eigen::ArrayXf sin_angle;
+  Eigen::ArrayXf lidar_x;
+  Eigen::ArrayXf lidar_y;
+  Eigen::ArrayXf end_x;
+  Eigen::ArrayXf end_y;
+  Eigen::ArrayXf distance;
+  Eigen::ArrayXf sq_error_sum;
+  // Number of real (not padding) particles.
+  size_t size;
+
+  void Pack(const std::vector<Particle>& particles);
+  void UnpackWeights(std::vector<Particle>* particles) const;
+};
+
+// Summary of the belief: weighted mean location, circular mean angle, and the
+// covariance of (x, y, angle).
+struct PoseEstimate {
+  Eigen::Vector2f loc;
+  float angle;
+  Eigen::Matrix3f covariance;
+
+  static PoseEstimate Zero() {
+    PoseEstimate estimate;
+    estimate.loc.setZero();
+    estimate.angle = 0;
+    estimate.covariance.setZero();
+    return estimate;
+  }
+};
+
 class ParticleFilter {
  public:
   // Default Constructor.
@@ -67,10 +113,24 @@ class ParticleFilter {
   void GetParticles(std::vector<Particle>* particles) const;
 
   // Get robot's current location.
+  // Safe to call from any thread, without locking.
   void GetLocation(Eigen::Vector2f* loc, float* angle) const;
 
+  // Get the mean and covariance of the belief. Safe to call from any thread,
+  // without locking.
+  void GetPoseEstimate(PoseEstimate* estimate) const;
+
   // Update a particle's location given current and last odom
   void UpdateParticleLocation(Eigen::Vector2f map_trans_diff, float dtheta_odom, Particle* p_ptr);
+  void UpdateParticleLocation(Eigen::Vector2f map_trans_diff,
+                              float dtheta_odom,
+                              util_random::Random* rng,
+                              Particle* p_ptr);
+  // Same, with three standard normal draws for the x, y and angle noise.
+  void UpdateParticleLocation(Eigen::Vector2f map_trans_diff,
+                              float dtheta_odom,
+                              const float* std_normals,
+                              Particle* p_ptr);
 
   // Update particle weight based on laser.
   void Update(const std::vector<float>& ranges,
@@ -98,15 +158,62 @@ class ParticleFilter {
 
  private:
 
+  // Log likelihood of a laser scan from a given pose, using the
+  // precomputed likelihood field instead of ray casting.
+  float LikelihoodFieldLogLikelihood(const std::vector<float>& ranges,
+                                     float range_min,
+                                     float range_max,
+                                     float angle_min,
+                                     float angle_max,
+                                     const Eigen::Vector2f& loc,
+                                     const float angle) const;
+
+  // Vectorized likelihood field update of particles [begin, end) of
+  // particle_arrays_. Update remains the reference implementation.
+  void BatchUpdate(const std::vector<float>& ranges,
+                   float range_min,
+                   float range_max,
+                   float angle_min,
+                   float angle_max,
+                   size_t begin,
+                   size_t end);
+
+  // Resampling with an adaptive number of particles.
+  double NormalizeWeights();
+  void UpdatePoseEstimate();
+  void KLDResample();
+  bool ShrinkParticles();
+  void UseResampledParticles();
+  uint64_t KLDBin(const Particle& particle) const;
+
+  // Multi-threaded particle updates.
+  int PrepareWorkers();
+  size_t WorkerBlockBegin(int worker, int num_workers) const;
+
   // List of particles being tracked.
   std::vector<Particle> particles_;
 
+  // Structure-of-arrays copy of particles_ used by BatchUpdate.
+  ParticleArrays particle_arrays_;
+
   // Map of the environment.
   vector_map::VectorMap map_;
 
+  // Distance to the nearest wall, rasterized from map_.
+  LikelihoodField likelihood_field_;
+
+  // Precomputed expected ranges, memory-mapped from disk.
+  RangeTable range_table_;
+
   // Random number generator.
   util_random::Random rng_;
 
+  // One random number stream per worker thread.
+  std::vector<util_random::Random> worker_rngs_;
+
+  // Motion model noise of each worker's block of particles.
+  std::vector<std::vector<float> > worker_noise_;
+
   // Previous odometry-reported locations.
   Eigen::Vector2f prev_odom_loc_;
   float prev_odom_angle_;
@@ -119,7 +226,17 @@ class ParticleFilter {
   float d_long_;
 
   // Resampling variables
-  float max_log_particle_weight_;
+  // Normalized weights of particles_.
+  std::vector<double> weights_;
+  // Cumulative normalized weights of particles_.
+  std::vector<double> weight_breakpoints_;
+  // Resampled particles are written here, then swapped with particles_.
+  std::vector<Particle> resample_buffer_;
+  // Hash set of histogram bins occupied during KLD-sampling.
+  std::vector<uint64_t> kld_bins_;
+
+  // Pose estimate from the latest particles, published for other threads.
+  util::SeqLock<PoseEstimate> pose_estimate_;
 };
 }  // namespace slam
 
@@ -0,0 +1,211 @@
+//========================================================================
+//  This software is free: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License Version 3,
+//  as published by the Free Software Foundation.
+//
+//  This software is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  Version 3 in the file COPYING that came with this distribution.
+//  If not, see <http://www.gnu.org/licenses/>.
+//========================================================================
+/*!
+\file    range_table.cc
+\brief   Precomputed expected laser ranges over a (x, y, theta) lattice,
+         stored in a quantized binary file that is memory-mapped at load.
+*/
+//========================================================================
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "eigen3/Eigen/Dense"
+#include "shared/math/line2d.h"
+#include "shared/math/math_util.h"
+
+#include "range_table.h"
+
+using Eigen::Vector2f;
+using geometry::line2f;
+using math_util::AngleMod;
+using std::string;
+using std::vector;
+
+namespace {
+const char kMagic[8] = {'R', 'N', 'G', 'T', 'A', 'B', 'L', 'E'};
+const uint32_t kVersion = 1;
+const float kMaxCount = std::numeric_limits<uint16_t>::max();
+}  // namespace
+
+namespace particle_filter {
+
+RangeTable::RangeTable() :
+    mapping_(NULL),
+    mapping_size_(0),
+    inv_resolution_(0),
+    angles_per_radian_(0),
+    meters_per_count_(0),
+    data_(NULL) {
+  memset(&header_, 0, sizeof(header_));
+}
+
+RangeTable::~RangeTable() {
+  Unload();
+}
+
+string RangeTable::TableFileForMap(const string& map_file) {
+  const size_t extension = map_file.rfind(".txt");
+  if (extension == string::npos) return map_file + ".ranges";
+  return map_file.substr(0, extension) + ".ranges";
+}
+
+bool RangeTable::Build(vector_map::VectorMap* map,
+                       float resolution,
+                       int num_angles,
+                       float max_range,
+                       const string& file) {
+  if (map->lines().empty() || resolution <= 0 || num_angles <= 0) return false;
+  Vector2f p_min(std::numeric_limits<float>::max(),
+                 std::numeric_limits<float>::max());
+  Vector2f p_max = -p_min;
+  for (const line2f& l : map->lines()) {
+    p_min = p_min.cwiseMin(l.p0).cwiseMin(l.p1);
+    p_max = p_max.cwiseMax(l.p0).cwiseMax(l.p1);
+  }
+
+  Header header;
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.origin_x = p_min.x();
+  header.origin_y = p_min.y();
+  header.resolution = resolution;
+  header.max_range = max_range;
+  header.num_angles = num_angles;
+  header.width = static_cast<uint32_t>(ceil((p_max.x() - p_min.x()) /
+                                            resolution));
+  header.height = static_cast<uint32_t>(ceil((p_max.y() - p_min.y()) /
+                                             resolution));
+
+  FILE* fid = fopen(file.c_str(), "wb");
+  if (fid == NULL) {
+    fprintf(stderr, "ERROR: Unable to write range table %s\n", file.c_str());
+    return false;
+  }
+  // A partly written table is removed, so that it is never loaded.
+  auto fail = [&]() {
+    fprintf(stderr, "ERROR: Unable to write range table %s\n", file.c_str());
+    fclose(fid);
+    remove(file.c_str());
+    return false;
+  };
+  if (fwrite(&header, sizeof(header), 1, fid) != 1) return fail();
+
+  // Written one row of cells at a time, so that memory use does not depend
+  // on the size of the map. The scans of a row are predicted in one batch.
+  const float counts_per_meter = kMaxCount / max_range;
+  vector<uint16_t> row(header.width * num_angles);
+  vector<Vector2f> locs(header.width);
+  const vector<float> angles(header.width, 0);
+  vector<float> scans;
+  for (uint32_t yi = 0; yi < header.height; ++yi) {
+    for (uint32_t xi = 0; xi < header.width; ++xi) {
+      locs[xi] = Vector2f(header.origin_x + (xi + 0.5) * resolution,
+                          header.origin_y + (yi + 0.5) * resolution);
+    }
+    map->GetPredictedScans(locs.data(), angles.data(), header.width,
+                           0, max_range, -M_PI, M_PI, num_angles, &scans);
+    for (size_t i = 0; i < row.size(); ++i) {
+      const float range = std::max(0.0f, std::min(max_range, scans[i]));
+      row[i] = static_cast<uint16_t>(range * counts_per_meter + 0.5);
+    }
+    if (fwrite(row.data(), sizeof(uint16_t), row.size(), fid) != row.size()) {
+      return fail();
+    }
+  }
+  // Buffered data is only written out, and can only fail, on close.
+  if (fclose(fid) != 0) {
+    fprintf(stderr, "ERROR: Unable to write range table %s\n", file.c_str());
+    remove(file.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool RangeTable::Load(const string& file) {
+  Unload();
+  const int fd = open(file.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 ||
+      static_cast<size_t>(file_stat.st_size) < sizeof(Header)) {
+    close(fd);
+    return false;
+  }
+  const size_t size = file_stat.st_size;
+  void* mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  // The mapping stays valid after the descriptor is closed.
+  close(fd);
+  if (mapping == MAP_FAILED) return false;
+
+  Header header;
+  memcpy(&header, mapping, sizeof(header));
+  const size_t expected_size = sizeof(Header) + sizeof(uint16_t) *
+      static_cast<size_t>(header.width) * header.height * header.num_angles;
+  if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+      header.version != kVersion ||
+      header.num_angles == 0 ||
+      size != expected_size) {
+    fprintf(stderr, "ERROR: Malformed range table %s\n", file.c_str());
+    munmap(mapping, size);
+    return false;
+  }
+
+  file_ = file;
+  mapping_ = mapping;
+  mapping_size_ = size;
+  header_ = header;
+  inv_resolution_ = 1.0 / header_.resolution;
+  angles_per_radian_ = header_.num_angles / (2.0 * M_PI);
+  meters_per_count_ = header_.max_range / kMaxCount;
+  data_ = reinterpret_cast<const uint16_t*>(
+      static_cast<const char*>(mapping_) + sizeof(Header));
+  return true;
+}
+
+void RangeTable::Unload() {
+  if (mapping_ != NULL) munmap(mapping_, mapping_size_);
+  mapping_ = NULL;
+  mapping_size_ = 0;
+  data_ = NULL;
+  file_.clear();
+}
+
+float RangeTable::Range(const Vector2f& loc, float angle) const {
+  const float u = (loc.x() - header_.origin_x) * inv_resolution_;
+  const float v = (loc.y() - header_.origin_y) * inv_resolution_;
+  if (u < 0 || v < 0 || u >= header_.width || v >= header_.height) {
+    return header_.max_range;
+  }
+  const size_t cell = static_cast<size_t>(v) * header_.width +
+      static_cast<size_t>(u);
+  // Angle bin i holds the ray at heading -pi + i * 2pi / num_angles.
+  int a = static_cast<int>(
+      (AngleMod(angle) + M_PI) * angles_per_radian_ + 0.5);
+  if (a >= static_cast<int>(header_.num_angles)) a -= header_.num_angles;
+  return meters_per_count_ * data_[cell * header_.num_angles + a];
+}
+
+}  // namespace particle_filter
@@ -0,0 +1,97 @@
+//========================================================================
+//  This software is free: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License Version 3,
+//  as published by the Free Software Foundation.
+//
+//  This software is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  Version 3 in the file COPYING that came with this distribution.
+//  If not, see <http://www.gnu.org/licenses/>.
+//========================================================================
+/*!
+\file    range_table.h
+\brief   Precomputed expected laser ranges over a (x, y, theta) lattice,
+         stored in a quantized binary file that is memory-mapped at load.
+*/
+//========================================================================
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "eigen3/Eigen/Dense"
+#include "vector_map/vector_map.h"
+
+#ifndef SRC_PARTICLE_FILTER_RANGE_TABLE_H_
+#define SRC_PARTICLE_FILTER_RANGE_TABLE_H_
+
+namespace particle_filter {
+
+class RangeTable {
+ public:
+  // File layout: one Header, followed by width * height * num_angles
+  // uint16_t ranges, angle-major within each cell, cells row-major.
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t num_angles;
+    float origin_x;
+    float origin_y;
+    float resolution;
+    float max_range;
+  };
+
+  RangeTable();
+  ~RangeTable();
+
+  // Ray cast the map from the center of every cell, at num_angles evenly
+  // spaced headings, and save the quantized ranges to file.
+  static bool Build(vector_map::VectorMap* map,
+                    float resolution,
+                    int num_angles,
+                    float max_range,
+                    const std::string& file);
+
+  // Memory-map a table written by Build. Returns false, leaving the table
+  // unloaded, if the file is missing or malformed.
+  bool Load(const std::string& file);
+
+  // Release the mapping.
+  void Unload();
+
+  bool IsLoaded() const { return data_ != NULL; }
+  const std::string& GetFile() const { return file_; }
+
+  // Expected range of a ray from loc at the given heading, from the nearest
+  // lattice point. Locations outside of the table return max_range.
+  float Range(const Eigen::Vector2f& loc, float angle) const;
+
+  // Table file to use alongside a map file, e.g. maps/GDC1.ranges for
+  // maps/GDC1.txt.
+  static std::string TableFileForMap(const std::string& map_file);
+
+ private:
+  // Disable copy constructor and assignment, the table owns its mapping.
+  RangeTable(const RangeTable&);
+  void operator=(const RangeTable&);
+
+  std::string file_;
+  void* mapping_;
+  size_t mapping_size_;
+  Header header_;
+  float inv_resolution_;
+  float angles_per_radian_;
+  float meters_per_count_;
+  const uint16_t* data_;
+};
+
+}  // namespace particle_filter
+
+#endif  // SRC_PARTICLE_FILTER_RANGE_TABLE_H_
@@ -0,0 +1,60 @@
+//========================================================================
+//  This software is free: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License Version 3,
+//  as published by the Free Software Foundation.
+//
+//  This software is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  Version 3 in the file COPYING that came with this distribution.
+//  If not, see <http://www.gnu.org/licenses/>.
+//========================================================================
+/*!
+\file    range_table_main.cc
+\brief   Offline tool to precompute the expected range table of a map, for
+         use by the particle filter with --range_table.
+\usage   ./bin/range_table --map=GDC1
+*/
+//========================================================================
+
+#include <stdio.h>
+
+#include <string>
+
+#include "gflags/gflags.h"
+#include "shared/util/timer.h"
+
+#include "range_table.h"
+#include "vector_map/vector_map.h"
+
+using particle_filter::RangeTable;
+using std::string;
+
+DEFINE_string(map, "GDC1", "Name of the map in maps/ to build a table for");
+DEFINE_double(resolution, 0.1, "Cell size of the table (meters)");
+DEFINE_int32(num_angles, 180, "Number of ray headings per cell");
+DEFINE_double(max_range, 10.0, "Maximum range of the laser (meters)");
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, false);
+  const string map_file = "maps/" + FLAGS_map + ".txt";
+  const string table_file = RangeTable::TableFileForMap(map_file);
+  vector_map::VectorMap map(map_file);
+  printf("Building range table for %s (%lu lines)\n",
+         map_file.c_str(), map.lines().size());
+  const double t_start = GetMonotonicTime();
+  if (!RangeTable::Build(&map,
+                         FLAGS_resolution,
+                         FLAGS_num_angles,
+                         FLAGS_max_range,
+                         table_file)) {
+    fprintf(stderr, "ERROR: Failed to build range table\n");
+    return 1;
+  }
+  printf("Wrote %s in %.1f s\n",
+         table_file.c_str(), GetMonotonicTime() - t_start);
+  return 0;
+}
@@ -0,0 +1,106 @@
+//========================================================================
+// This software is free: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License Version 3,
+// as published by the Free Software Foundation.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// Version 3 in the file COPYING that came with this distribution.
+// If not, see <http://www.gnu.org/licenses/>.
+// ========================================================================
+// Exact squared Euclidean distance transforms on regular grids, using the
+// lower-envelope-of-parabolas algorithm of Felzenszwalb and Huttenlocher,
+// "Distance Transforms of Sampled Functions", 2012. Both passes are linear
+// in the number of cells.
+// ========================================================================
+
+#ifndef SRC_MATH_DISTANCE_TRANSFORM_H_
+#define SRC_MATH_DISTANCE_TRANSFORM_H_
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+namespace distance_transform {
+
+// Value to use for cells that do not contain a site.
+template <typename T>
+T Infinity() {
+  return std::numeric_limits<T>::max();
+}
+
+// One dimensional squared distance transform:
+//   d[p] = min_q ( (p - q)^2 + f[q] ).
+// f and d must each hold n values, and must not alias. v and z are scratch
+// buffers of at least n and n + 1 elements respectively, so that callers
+// transforming many lines can reuse them.
+template <typename T>
+void SquaredDistanceTransform1D(const T* f, int n, T* d, int* v, T* z) {
+  const T kInf = Infinity<T>();
+  // Skip leading cells without a finite value, they can never be parabola
+  // roots.
+  int first = 0;
+  while (first < n && f[first] >= kInf) ++first;
+  if (first == n) {
+    std::fill(d, d + n, kInf);
+    return;
+  }
+  int k = 0;
+  v[0] = first;
+  z[0] = -kInf;
+  z[1] = kInf;
+  for (int q = first + 1; q < n; ++q) {
+    if (f[q] >= kInf) continue;
+    T s = 0;
+    // z[0] is -kInf, so this always terminates with k >= 0.
+    while (true) {
+      const int r = v[k];
+      s = ((f[q] + T(q * q)) - (f[r] + T(r * r))) / T(2 * (q - r));
+      if (s > z[k]) break;
+      --k;
+    }
+    ++k;
+    v[k] = q;
+    z[k] = s;
+    z[k + 1] = kInf;
+  }
+  k = 0;
+  for (int p = 0; p < n; ++p) {
+    while (z[k + 1] < T(p)) ++k;
+    const T dp = T(p - v[k]);
+    d[p] = dp * dp + f[v[k]];
+  }
+}
+
+// Two dimensional squared distance transform, in place, over a row-major
+// grid of width x height cells. Cells containing a site must hold 0, and all
+// other cells Infinity<T>(). On return every cell holds the squared distance,
+// in cells, to the nearest site, or Infinity<T>() if there are no sites.
+template <typename T>
+void SquaredDistanceTransform2D(int width, int height, T* grid) {
+  const int n = std::max(width, height);
+  std::vector<T> f(n);
+  std::vector<T> d(n);
+  std::vector<int> v(n);
+  std::vector<T> z(n + 1);
+  // Columns first.
+  for (int x = 0; x < width; ++x) {
+    for (int y = 0; y < height; ++y) f[y] = grid[y * width + x];
+    SquaredDistanceTransform1D(f.data(), height, d.data(), v.data(), z.data());
+    for (int y = 0; y < height; ++y) grid[y * width + x] = d[y];
+  }
+  // Then rows, which are contiguous.
+  for (int y = 0; y < height; ++y) {
+    T* row = grid + y * width;
+    std::copy(row, row + width, f.begin());
+    SquaredDistanceTransform1D(f.data(), width, row, v.data(), z.data());
+  }
+}
+
+}  // namespace distance_transform
+
+#endif  // SRC_MATH_DISTANCE_TRANSFORM_H_
@@ -0,0 +1,51 @@
+// This software is free: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License Version 3,
+// as published by the Free Software Foundation.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// Version 3 in the file COPYING that came with this distribution.
+// If not, see <http://www.gnu.org/licenses/>.
+// ========================================================================
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "math/distance_transform.h"
+
+using distance_transform::Infinity;
+using distance_transform::SquaredDistanceTransform2D;
+
+TEST(SquaredDistanceTransform2D, NoSites) {
+  std::vector<float> grid(12, Infinity<float>());
+  SquaredDistanceTransform2D(4, 3, grid.data());
+  for (const float d : grid) {
+    EXPECT_EQ(Infinity<float>(), d);
+  }
+}
+
+TEST(SquaredDistanceTransform2D, MatchesBruteForce) {
+  const int kWidth = 7;
+  const int kHeight = 5;
+  const int kSites[][2] = {{0, 0}, {6, 1}, {3, 4}};
+  std::vector<float> grid(kWidth * kHeight, Infinity<float>());
+  for (const auto& s : kSites) grid[s[1] * kWidth + s[0]] = 0;
+  SquaredDistanceTransform2D(kWidth, kHeight, grid.data());
+  for (int y = 0; y < kHeight; ++y) {
+    for (int x = 0; x < kWidth; ++x) {
+      int best = kWidth * kWidth + kHeight * kHeight;
+      for (const auto& s : kSites) {
+        const int dx = x - s[0];
+        const int dy = y - s[1];
+        best = std::min(best, dx * dx + dy * dy);
+      }
+      EXPECT_FLOAT_EQ(static_cast<float>(best), grid[y * kWidth + x]);
+    }
+  }
+}
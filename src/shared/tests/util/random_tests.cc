@@ -0,0 +1,109 @@
+// This software is free: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License Version 3,
+// as published by the Free Software Foundation.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// Version 3 in the file COPYING that came with this distribution.
+// If not, see <http://www.gnu.org/licenses/>.
+// ========================================================================
+
+#include <gtest/gtest.h>
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "util/random.h"
+
+using std::vector;
+using util_random::Random;
+
+// Outputs of the reference splitmix64 seeding and xoshiro256++ code by
+// Blackman and Vigna.
+TEST(Random, MatchesReferenceOutputs) {
+  {
+    Random rng(1);
+    EXPECT_EQ(0xcfc5d07f6f03c29bULL, rng());
+    EXPECT_EQ(0xbf424132963fe08dULL, rng());
+    EXPECT_EQ(0x19a37d5757aaf520ULL, rng());
+    EXPECT_EQ(0xbf08119f05cd56d6ULL, rng());
+  }
+  {
+    Random rng(12345);
+    EXPECT_EQ(0x8d948a82def8a568ULL, rng());
+    EXPECT_EQ(0x3477f953796702a0ULL, rng());
+  }
+  {
+    Random rng;
+    rng.Seed(12345);
+    EXPECT_EQ(0x8d948a82def8a568ULL, rng());
+  }
+}
+
+TEST(Random, JumpMatchesReference) {
+  Random rng(1);
+  rng.Jump();
+  EXPECT_EQ(0xdafd92f1adffc5b9ULL, rng());
+  EXPECT_EQ(0x89d5ed6828f5becfULL, rng());
+  EXPECT_EQ(0xc81a7b85673e9dacULL, rng());
+  EXPECT_EQ(0xe3ed98a07ef5a746ULL, rng());
+
+  Random stream2(1, 2);
+  EXPECT_EQ(0xcf14ec0cd23320f2ULL, stream2());
+  EXPECT_EQ(0x0d996ecdd4a89305ULL, stream2());
+}
+
+TEST(Random, StreamsAreIndependent) {
+  const int kNumStreams = 4;
+  const int kNumDraws = 10000;
+  vector<uint64_t> draws;
+  for (int stream = 0; stream < kNumStreams; ++stream) {
+    Random rng(7, stream);
+    Random jumped(7);
+    for (int i = 0; i < stream; ++i) jumped.Jump();
+    for (int i = 0; i < kNumDraws; ++i) {
+      const uint64_t x = rng();
+      ASSERT_EQ(jumped(), x);
+      draws.push_back(x);
+    }
+  }
+  // No stream repeats a value drawn by another, as they would if the streams
+  // overlapped.
+  std::sort(draws.begin(), draws.end());
+  EXPECT_TRUE(std::adjacent_find(draws.begin(), draws.end()) == draws.end());
+
+  // Nor are neighbouring streams correlated.
+  Random a(7, 0);
+  Random b(7, 1);
+  double sum_ab = 0;
+  for (int i = 0; i < kNumDraws; ++i) {
+    sum_ab += (a.UniformRandom() - 0.5) * (b.UniformRandom() - 0.5);
+  }
+  // The standard deviation of the mean product is 1 / (12 sqrt(n)).
+  EXPECT_LT(std::abs(sum_ab / kNumDraws), 5.0 / (12.0 * 100.0));
+}
+
+TEST(Random, UniformRandomRange) {
+  Random rng(3);
+  double min_value = 1;
+  double max_value = 0;
+  for (int i = 0; i < 100000; ++i) {
+    const double x = rng.UniformRandom();
+    ASSERT_GE(x, 0.0);
+    ASSERT_LT(x, 1.0);
+    min_value = std::min(min_value, x);
+    max_value = std::max(max_value, x);
+    const double y = rng.UniformRandom(-2, 3);
+    ASSERT_GE(y, -2.0);
+    ASSERT_LT(y, 3.0);
+  }
+  EXPECT_LT(min_value, 1e-3);
+  EXPECT_GT(max_value, 1 - 1e-3);
+}
@@ -0,0 +1,93 @@
+// This software is free: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License Version 3,
+// as published by the Free Software Foundation.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// Version 3 in the file COPYING that came with this distribution.
+// If not, see <http://www.gnu.org/licenses/>.
+// ========================================================================
+
+#include <gtest/gtest.h>
+
+#include <stdint.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "util/seqlock.h"
+
+using std::vector;
+using util::SeqLock;
+
+namespace {
+
+// Spans many words, so that a torn read would mix fields of different
+// writes.
+struct Value {
+  int64_t sequence;
+  double fields[15];
+};
+
+Value MakeValue(int64_t sequence) {
+  Value value;
+  value.sequence = sequence;
+  for (int i = 0; i < 15; ++i) value.fields[i] = sequence * (i + 1);
+  return value;
+}
+
+}  // namespace
+
+TEST(SeqLock, LoadReturnsStoredValue) {
+  SeqLock<Value> lock(MakeValue(3));
+  EXPECT_EQ(3, lock.Load().sequence);
+  lock.Store(MakeValue(4));
+  const Value value = lock.Load();
+  EXPECT_EQ(4, value.sequence);
+  for (int i = 0; i < 15; ++i) EXPECT_EQ(4.0 * (i + 1), value.fields[i]);
+}
+
+TEST(SeqLock, ConcurrentReadersNeverSeeTornValues) {
+  const int64_t kNumWrites = 200000;
+  const int kNumReaders = 4;
+  SeqLock<Value> lock(MakeValue(0));
+  std::atomic<bool> done(false);
+  std::atomic<int> torn_reads(0);
+  std::atomic<int> out_of_order_reads(0);
+  std::atomic<int64_t> num_reads(0);
+
+  vector<std::thread> readers;
+  for (int r = 0; r < kNumReaders; ++r) {
+    readers.push_back(std::thread([&]() {
+      int64_t last_sequence = 0;
+      int64_t reads = 0;
+      while (!done.load(std::memory_order_acquire)) {
+        const Value value = lock.Load();
+        for (int i = 0; i < 15; ++i) {
+          if (value.fields[i] != value.sequence * (i + 1)) {
+            ++torn_reads;
+            break;
+          }
+        }
+        // A reader never sees an older value than one it has already seen.
+        if (value.sequence < last_sequence) ++out_of_order_reads;
+        last_sequence = value.sequence;
+        ++reads;
+      }
+      num_reads += reads;
+    }));
+  }
+  for (int64_t i = 1; i <= kNumWrites; ++i) lock.Store(MakeValue(i));
+  done.store(true, std::memory_order_release);
+  for (std::thread& reader : readers) reader.join();
+
+  EXPECT_EQ(0, torn_reads.load());
+  EXPECT_EQ(0, out_of_order_reads.load());
+  EXPECT_GT(num_reads.load(), 0);
+  EXPECT_EQ(kNumWrites, lock.Load().sequence);
+}
@@ -20,21 +20,98 @@
 //========================================================================
 #include "random.h"
 
+#include <math.h>
+
 #include <random>
 
 
 namespace util_random {
 
+void Random::Seed(unsigned long seed) {
+  // Expand the seed with splitmix64, as recommended for xoshiro generators,
+  // so that nearby seeds give unrelated streams.
+  uint64_t x = seed;
+  for (int i = 0; i < 4; ++i) {
+    x += 0x9E3779B97F4A7C15ull;
+    uint64_t z = x;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    state_[i] = z ^ (z >> 31);
+  }
+  has_spare_ = false;
+  spare_ = 0;
+}
+
+void Random::Jump() {
+  static const uint64_t kJump[] = { 0x180EC6D33CFD0ABAull,
+                                    0xD5A61266F0C9392Cull,
+                                    0xA9582618E03FC9AAull,
+                                    0x39ABDC4529B1661Cull };
+  uint64_t s[4] = {0, 0, 0, 0};
+  for (int i = 0; i < 4; ++i) {
+    for (int b = 0; b < 64; ++b) {
+      if (kJump[i] & (1ull << b)) {
+        for (int j = 0; j < 4; ++j) s[j] ^= state_[j];
+      }
+      (*this)();
+    }
+  }
+  for (int j = 0; j < 4; ++j) state_[j] = s[j];
+  has_spare_ = false;
+}
+
 double Random::UniformRandom(double a, double b) {
   return (b - a) * UniformRandom() + a;
 }
 
-double Random::UniformRandom() {
-  return randf_(generator_);
+void Random::StandardNormalPair(double* z0, double* z1) {
+  // Marsaglia's polar form of the Box-Muller transform, which avoids the
+  // trigonometric functions by sampling a point in the unit disc.
+  double u, v, s;
+  do {
+    u = 2.0 * UniformRandom() - 1.0;
+    v = 2.0 * UniformRandom() - 1.0;
+    s = u * u + v * v;
+  } while (s >= 1.0 || s == 0.0);
+  const double scale = sqrt(-2.0 * log(s) / s);
+  *z0 = u * scale;
+  *z1 = v * scale;
 }
 
 double Random::Gaussian(const double mean, const double stddev) {
-  return mean + stddev * randn_(generator_);
+  if (has_spare_) {
+    has_spare_ = false;
+    return mean + stddev * spare_;
+  }
+  double z;
+  StandardNormalPair(&z, &spare_);
+  has_spare_ = true;
+  return mean + stddev * z;
+}
+
+void Random::FillGaussian(float* values, size_t n, float mean, float stddev) {
+  size_t i = 0;
+  for (; i + 1 < n; i += 2) {
+    double z0, z1;
+    StandardNormalPair(&z0, &z1);
+    values[i] = mean + stddev * z0;
+    values[i + 1] = mean + stddev * z1;
+  }
+  if (i < n) values[i] = Gaussian(mean, stddev);
+}
+
+void Random::FillGaussian(double* values,
+                          size_t n,
+                          double mean,
+                          double stddev) {
+  size_t i = 0;
+  for (; i + 1 < n; i += 2) {
+    double z0, z1;
+    StandardNormalPair(&z0, &z1);
+    values[i] = mean + stddev * z0;
+    values[i + 1] = mean + stddev * z1;
+  }
+  if (i < n) values[i] = Gaussian(mean, stddev);
 }
 
 }  // namespace util_random
@@ -19,6 +19,9 @@
 // If not, see <http://www.gnu.org/licenses/>.
 //========================================================================
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include <random>
 
 #ifndef SRC_UTIL_RANDOM_H_
@@ -26,34 +29,82 @@
 
 // Your one-stop shop for generating random numbers.
 namespace util_random {
+// Backed by xoshiro256++ (Blackman and Vigna), with Gaussians from the polar
+// Box-Muller transform. Random also satisfies the standard uniform random bit
+// generator requirements, so it can be used with <random> distributions.
 class Random {
  public:
-  Random() : randn_(0, 1.0), randf_(0.0, 1.0) {}
+  typedef uint64_t result_type;
+
+  Random() { Seed(1); }
 
-  Random(unsigned long seed): generator_(seed),
-                              randn_(0, 1.0),
-                              randf_(0.0, 1.0) {}
+  explicit Random(unsigned long seed) { Seed(seed); }
+
+  // Independent stream number `stream` of the sequence for a seed, for use by
+  // parallel workers. Streams are 2^128 draws apart, so they never overlap.
+  Random(unsigned long seed, int stream) {
+    Seed(seed);
+    for (int i = 0; i < stream; ++i) Jump();
+  }
 
-  // Generate random numbers between 0 and 1, inclusive.
-  double UniformRandom();
+  // Restart the sequence from a seed.
+  void Seed(unsigned long seed);
+
+  // Advance the generator by 2^128 draws.
+  void Jump();
+
+  // Raw 64 bit output.
+  result_type operator()() {
+    const uint64_t result = Rotl(state_[0] + state_[3], 23) + state_[0];
+    const uint64_t t = state_[1] << 17;
+    state_[2] ^= state_[0];
+    state_[3] ^= state_[1];
+    state_[1] ^= state_[2];
+    state_[0] ^= state_[3];
+    state_[2] ^= t;
+    state_[3] = Rotl(state_[3], 45);
+    return result;
+  }
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return UINT64_MAX; }
 
-  // Generate random numbers between a and b, inclusive.
+  // Generate random numbers between 0, inclusive, and 1, exclusive.
+  double UniformRandom() {
+    // The top 53 bits fill the mantissa of a double.
+    return static_cast<double>((*this)() >> 11) * (1.0 / 9007199254740992.0);
+  }
+
+  // Generate random numbers between a, inclusive, and b, exclusive.
   double UniformRandom(double a, double b);
 
-  // Generate random numbers between min, inclusive, and max, exclusive.
+  // Generate random numbers between min and max, inclusive.
   template <typename T>
   T RandomInt(const T min, const T max) {
     std::uniform_int_distribution<T> dist(min, max);
-    return dist(generator_);
+    return dist(*this);
   }
 
   // Return a random value drawn from a Normal distribution.
   double Gaussian(const double mean, const double stddev);
 
+  // Fill values[0] to values[n - 1] with independent draws from a Normal
+  // distribution. Faster than calling Gaussian n times.
+  void FillGaussian(float* values, size_t n, float mean, float stddev);
+  void FillGaussian(double* values, size_t n, double mean, double stddev);
+
  private:
-  std::default_random_engine generator_;
-  std::normal_distribution<double> randn_;
-  std::uniform_real_distribution<double> randf_;
+  static uint64_t Rotl(const uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+  }
+
+  // A pair of independent standard normal values.
+  void StandardNormalPair(double* z0, double* z1);
+
+  uint64_t state_[4];
+  // Box-Muller produces values in pairs, the second is kept for the next
+  // call to Gaussian.
+  bool has_spare_;
+  double spare_;
 };
 }  // namespace util_random
 #endif  // SRC_UTIL_RANDOM_H_
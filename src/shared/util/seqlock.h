@@ -0,0 +1,88 @@
+//========================================================================
+// This software is free: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License Version 3,
+// as published by the Free Software Foundation.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// Version 3 in the file COPYING that came with this distribution.
+// If not, see <http://www.gnu.org/licenses/>.
+// ========================================================================
+// Sequence lock for publishing a small value from one writer thread to any
+// number of reader threads. Neither side blocks: readers retry if the value
+// was overwritten while they were copying it.
+// ========================================================================
+
+#ifndef SRC_UTIL_SEQLOCK_H_
+#define SRC_UTIL_SEQLOCK_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+
+namespace util {
+
+// T is copied as raw bytes, so it must not own memory or hold pointers into
+// itself, e.g. plain structs of numbers and fixed-size Eigen types. Only one
+// thread may call Store at a time.
+template <typename T>
+class SeqLock {
+ public:
+  explicit SeqLock(const T& value) : sequence_(0) {
+    for (size_t i = 0; i < kNumWords; ++i) {
+      words_[i].store(0, std::memory_order_relaxed);
+    }
+    Store(value);
+  }
+
+  void Store(const T& value) {
+    uint32_t buffer[kNumWords] = {0};
+    memcpy(buffer, &value, sizeof(T));
+    // An odd sequence number marks a write in progress.
+    const uint32_t sequence = sequence_.load(std::memory_order_relaxed);
+    sequence_.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < kNumWords; ++i) {
+      words_[i].store(buffer[i], std::memory_order_relaxed);
+    }
+    sequence_.store(sequence + 2, std::memory_order_release);
+  }
+
+  T Load() const {
+    uint32_t buffer[kNumWords];
+    uint32_t sequence_before, sequence_after;
+    do {
+      sequence_before = sequence_.load(std::memory_order_acquire);
+      for (size_t i = 0; i < kNumWords; ++i) {
+        buffer[i] = words_[i].load(std::memory_order_relaxed);
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      sequence_after = sequence_.load(std::memory_order_relaxed);
+    } while ((sequence_before & 1) != 0 || sequence_before != sequence_after);
+    T value;
+    memcpy(static_cast<void*>(&value), buffer, sizeof(T));
+    return value;
+  }
+
+ private:
+  static const size_t kNumWords = (sizeof(T) + 3) / 4;
+
+  // Disable copy constructor and assignment.
+  SeqLock(const SeqLock&);
+  void operator=(const SeqLock&);
+
+  std::atomic<uint32_t> sequence_;
+  // The value is copied word by word through atomics, so that a read racing
+  // with a write is well defined. The sequence number tells readers to
+  // discard such a torn copy.
+  std::atomic<uint32_t> words_[kNumWords];
+};
+
+}  // namespace util
+
+#endif  // SRC_UTIL_SEQLOCK_H_
@@ -1,5 +1,8 @@
 #include "CellGrid.h"
 #include <iostream>
+#include <limits>
+
+#include "shared/math/distance_transform.h"
 
 using Eigen::Vector2f;
 using std::array;
@@ -9,14 +12,19 @@ using std::endl;
 
 // Custom Constructor
 CellGrid::CellGrid(Vector2f ORIGIN, float RES, float WIDTH, float HEIGHT) : 
-min_cost_(-1000)
+min_cost_(-1000),
+kernel_radius_(0),
+kernel_std_dev_(0),
+kernel_resolution_(0)
 {
 	origin_ = ORIGIN;
 	resolution_ = RES;
+	inv_resolution_ = 1.0 / RES;
 	width_ = ceil(WIDTH/RES);
 	height_ = ceil(HEIGHT/RES);
-	grid_.resize(width_);
-	for(auto &row : grid_) row.resize(height_);
+	// Round up to whole tiles, the cells past the edges are never used
+	x_tiles_ = (width_ + kTileSize - 1) / kTileSize;
+	reset();
 }
 
 // Getters
@@ -26,6 +34,7 @@ int      CellGrid::getXCellCount() const {return width_;}
 int      CellGrid::getYCellCount() const {return height_;}
 float    CellGrid::getWidth()      const {return width_ * resolution_;}
 float    CellGrid::getHeight()     const {return height_ * resolution_;}
+float    CellGrid::getMinCost()    const {return min_cost_;}
 
 // Get the cell index of a location
 std::array<int, 2> CellGrid::getIndex(const Vector2f loc) const{
@@ -47,72 +56,232 @@ Vector2f CellGrid::getLoc(int xi, int yi) const{
 // Retrieve a grid value using a location
 float& CellGrid::atLoc(const Vector2f loc){
 	array<int,2> indices = getIndex(loc);
-	return(grid_[indices[0]][indices[1]]);
+	return(at(indices[0], indices[1]));
 }
 
-// Retrieve a grid value using an index
-std::vector<float> &CellGrid::operator [](int i){
-	return(grid_[i]);
+// Look up many grid values, with a fixed value outside the grid
+void CellGrid::gather(const Vector2f* locs, size_t n, float outside_value, float* values) const{
+	for (size_t i = 0; i < n; i++){
+		if (not tryAt(locs[i], &values[i])) values[i] = outside_value;
+	}
 }
 
-// Determine whether an index is in bounds
-bool CellGrid::checkXLim(int xi) const {return(xi >= 0 and xi < width_);}
-bool CellGrid::checkYLim(int yi) const {return(yi >= 0 and yi < height_);}
+// Catmull-Rom weights of the four cells around a point, t of the way from the
+// second to the third, and their derivatives with respect to t
+static void cubicWeights(float t, float* w, float* dw){
+	const float t2 = t*t;
+	const float t3 = t2*t;
+	w[0] = 0.5f*(-t3 + 2*t2 - t);
+	w[1] = 0.5f*(3*t3 - 5*t2 + 2);
+	w[2] = 0.5f*(-3*t3 + 4*t2 + t);
+	w[3] = 0.5f*(t3 - t2);
+	dw[0] = 0.5f*(-3*t2 + 4*t - 1);
+	dw[1] = 0.5f*(9*t2 - 10*t);
+	dw[2] = 0.5f*(-9*t2 + 8*t + 1);
+	dw[3] = 0.5f*(3*t2 - 2*t);
+}
+
+float CellGrid::interpolate(const Vector2f& loc, Vector2f* gradient) const{
+	const float u = (loc.x() - origin_.x()) * inv_resolution_ - 0.5f;
+	const float v = (loc.y() - origin_.y()) * inv_resolution_ - 0.5f;
+	const int x1 = static_cast<int>(std::floor(u));
+	const int y1 = static_cast<int>(std::floor(v));
+	float wx[4], dwx[4], wy[4], dwy[4];
+	cubicWeights(u - x1, wx, dwx);
+	cubicWeights(v - y1, wy, dwy);
+
+	float value = 0, du = 0, dv = 0;
+	for (int j = 0; j < 4; j++){
+		const int yi = std::min(height_ - 1, std::max(0, y1 - 1 + j));
+		float row = 0, drow = 0;
+		for (int i = 0; i < 4; i++){
+			const int xi = std::min(width_ - 1, std::max(0, x1 - 1 + i));
+			const float cell = cellValue(xi, yi);
+			row += wx[i] * cell;
+			drow += dwx[i] * cell;
+		}
+		value += wy[j] * row;
+		du += wy[j] * drow;
+		dv += dwy[j] * row;
+	}
+	*gradient = Vector2f(du, dv) * inv_resolution_;
+	return value;
+}
 
 // Clear the history in the grid
 void CellGrid::clear(){
-	for (auto &row : grid_){
-	std::fill(row.begin(), row.end(), min_cost_);
+	for (int tile : written_tiles_){
+		tiles_[tile] = empty_tile_;
+		tile_written_[tile] = 0;
+	}
+	written_tiles_.clear();
+}
+
+void CellGrid::reset(){
+	const int y_tiles = (height_ + kTileSize - 1) / kTileSize;
+	empty_tile_ = std::make_shared<Tile>();
+	std::fill_n(empty_tile_->cells, kTileArea, min_cost_);
+	tiles_.assign(x_tiles_ * y_tiles, empty_tile_);
+	tile_written_.assign(x_tiles_ * y_tiles, 0);
+	written_tiles_.clear();
+}
+
+int CellGrid::countUniqueTiles() const{
+	int count = 0;
+	for (int tile : written_tiles_){
+		if (tiles_[tile].use_count() == 1) count++;
+	}
+	return count;
+}
+
+// Propagate a laser scan's probability distribution
+// Precompute the log-likelihood stamped around a laser point, over the
+// square of cells where it is at least min_cost_
+void CellGrid::buildKernel(float std_dev){
+	float variance = std_dev*std_dev;
+	int radius = 0;
+	while (-pow((radius+1)*resolution_, 2) / variance >= min_cost_) radius++;
+
+	const int side = 2*radius + 1;
+	kernel_.resize(side*side);
+	for (int dyi = -radius; dyi <= radius; dyi++){
+		for (int dxi = -radius; dxi <= radius; dxi++){
+			float dx = dxi*resolution_;
+			float dy = dyi*resolution_;
+			float offset_squared = pow(dx, 2) + pow(dy, 2);
+			float log_weight = -offset_squared / variance;
+			// Cells below min_cost_ in the corners of the square are left unchanged
+			if (log_weight < min_cost_) log_weight = -std::numeric_limits<float>::infinity();
+			kernel_[(dyi + radius)*side + (dxi + radius)] = log_weight;
+		}
 	}
+	kernel_radius_ = radius;
+	kernel_std_dev_ = std_dev;
+	kernel_resolution_ = resolution_;
 }
 
 // Propagate a laser scan's probability distribution
 void CellGrid::applyLaserPoint(Vector2f loc, float std_dev){
-	array<int,2> startIndex;
-	try{
-		startIndex = getIndex(loc);
-	}catch(std::out_of_range){
-		return;
+	int x0, y0;
+	if (not tryIndex(loc, &x0, &y0)) return;
+	if (std_dev != kernel_std_dev_ or resolution_ != kernel_resolution_) buildKernel(std_dev);
+
+	// Max-blend the kernel into the grid, over the part of it inside the grid.
+	// Rows of cells are contiguous within each tile, so a row is blended in
+	// runs of up to kTileSize cells.
+	const int radius = kernel_radius_;
+	const int side = 2*radius + 1;
+	const int x_begin = std::max(0, x0 - radius);
+	const int x_end = std::min(width_, x0 + radius + 1);
+	const int y_begin = std::max(0, y0 - radius);
+	const int y_end = std::min(height_, y0 + radius + 1);
+	for (int yi = y_begin; yi < y_end; yi++){
+		const float* kernel_row = &kernel_[(yi - y0 + radius)*side];
+		int xi = x_begin;
+		while (xi < x_end){
+			const int run_end = std::min(x_end, (xi | (kTileSize - 1)) + 1);
+			Eigen::Map<Eigen::ArrayXf> cells(&at(xi, yi), run_end - xi);
+			cells = cells.max(Eigen::Map<const Eigen::ArrayXf>(kernel_row + (xi - x0 + radius), run_end - xi));
+			xi = run_end;
+		}
+	}
+}
+
+// Same result as applyLaserPoint on each point, computed for the whole grid
+// at once from the squared distance transform of the points' cells
+void CellGrid::applyLaserPoints(const vector<Vector2f> &points, float std_dev){
+	distances_.assign(width_*height_, distance_transform::Infinity<float>());
+	bool any_inside = false;
+	for (const Vector2f &p : points){
+		int xi, yi;
+		if (not tryIndex(p, &xi, &yi)) continue;
+		distances_[yi*width_ + xi] = 0;
+		any_inside = true;
 	}
-	int x0 = startIndex[0];
-	int y0 = startIndex[1];
+	if (not any_inside) return;
+
+	distance_transform::SquaredDistanceTransform2D(width_, height_, distances_.data());
 
 	float variance = std_dev*std_dev;
+	const float scale = resolution_*resolution_ / variance;
+	for (int yi = 0; yi < height_; yi++){
+		for (int xi = 0; xi < width_; xi++){
+			float log_weight = -distances_[yi*width_ + xi] * scale;
+			if (log_weight >= min_cost_) at(xi, yi) = std::max(log_weight, at(xi, yi));
+		}
+	}
+}
 
-	bool too_far_x = false;
-	int dxi = 0;
-	while (not too_far_x){
-
-		bool too_far_y = false;
-		int dyi = 0;
-		while (not too_far_y){
-			
-			try{
-				float dx = dxi*resolution_;
-				float dy = dyi*resolution_;
-				float offset_squared = pow(dx, 2) + pow(dy, 2);
-				float log_weight = -offset_squared / variance;
-
-				if ( checkXLim(x0+dxi) and checkYLim(y0+dyi) ) grid_[x0+dxi][y0+dyi] = std::max(log_weight, grid_[x0+dxi][y0+dyi]); // Check the index represented by ( xi,  yi)
-				if ( checkXLim(x0+dxi) and checkYLim(y0-dyi) ) grid_[x0+dxi][y0-dyi] = std::max(log_weight, grid_[x0+dxi][y0-dyi]); // Check the index represented by ( xi, -yi)
-				if ( checkXLim(x0-dxi) and checkYLim(y0+dyi) ) grid_[x0-dxi][y0+dyi] = std::max(log_weight, grid_[x0-dxi][y0+dyi]); // Check the index represented by (-xi,  yi)
-				if ( checkXLim(x0-dxi) and checkYLim(y0-dyi) ) grid_[x0-dxi][y0-dyi] = std::max(log_weight, grid_[x0-dxi][y0-dyi]); // Check the index represented by (-xi, -yi)
-
-				dyi++;
-				too_far_y = log_weight < min_cost_;
-
-			}catch(std::out_of_range){
-				continue;
+// Copy the tiles within reach of the kernel around each point. The distance
+// transform's reach is worked out the way applyLaserPoints rounds it, which can
+// put it a cell past the kernel's.
+void CellGrid::makeWritable(const vector<Vector2f> &points, float std_dev){
+	if (std_dev != kernel_std_dev_ or resolution_ != kernel_resolution_) buildKernel(std_dev);
+	float variance = std_dev*std_dev;
+	const float scale = resolution_*resolution_ / variance;
+	int radius = kernel_radius_;
+	while (-static_cast<float>((radius + 1)*(radius + 1)) * scale >= min_cost_) radius++;
+	// Neighboring points of a scan mostly reach the same tiles
+	Eigen::Vector4i last_tiles(-1, -1, -1, -1);
+	for (const Vector2f &p : points){
+		int x0, y0;
+		if (not tryIndex(p, &x0, &y0)) continue;
+		const Eigen::Vector4i tiles(std::max(0, x0 - radius) >> kTileBits, std::min(width_ - 1, x0 + radius) >> kTileBits,
+		                            std::max(0, y0 - radius) >> kTileBits, std::min(height_ - 1, y0 + radius) >> kTileBits);
+		if (tiles == last_tiles) continue;
+		last_tiles = tiles;
+		for (int ty = tiles[2]; ty <= tiles[3]; ty++){
+			for (int tx = tiles[0]; tx <= tiles[1]; tx++){
+				writableValue(tx << kTileBits, ty << kTileBits);
 			}
-
 		}
+	}
+}
 
-	dxi++;
-	too_far_x = -pow(dxi*resolution_, 2) / variance < min_cost_;
+// Fill this grid with the maxima of 2x2 blocks of cells of a finer grid, at
+// half its resolution. Cell (xi, yi) of level k of such a pyramid holds the
+// maximum over cells (xi*2^k, yi*2^k) to ((xi+1)*2^k - 1, (yi+1)*2^k - 1) of
+// the original grid.
+//
+// The 2x2 blocks pooled into a cell never straddle tiles of the finer grid,
+// so only the cells pooled from its written tiles can differ from min_cost_.
+void CellGrid::maxPoolFrom(const CellGrid &finer){
+	const int width = (finer.width_ + 1) / 2;
+	const int height = (finer.height_ + 1) / 2;
+	if (width != width_ or height != height_ or resolution_ != 2*finer.resolution_ or min_cost_ != finer.min_cost_){
+		origin_ = finer.origin_;
+		resolution_ = 2*finer.resolution_;
+		inv_resolution_ = 1.0 / resolution_;
+		width_ = width;
+		height_ = height;
+		x_tiles_ = (width_ + kTileSize - 1) / kTileSize;
+		min_cost_ = finer.min_cost_;
+		reset();
+	} else {
+		clear();
+	}
+	const int half_tile = kTileSize / 2;
+	for (int tile : finer.written_tiles_){
+		const int x_begin = (tile % finer.x_tiles_) * half_tile;
+		const int y_begin = (tile / finer.x_tiles_) * half_tile;
+		const int x_end = std::min(width_, x_begin + half_tile);
+		const int y_end = std::min(height_, y_begin + half_tile);
+		for (int yi = y_begin; yi < y_end; yi++){
+			const int y0 = 2*yi;
+			const int y1 = std::min(y0 + 1, finer.height_ - 1);
+			// The half tile row is within one row of a tile of this grid
+			float* row = &at(x_begin, yi);
+			for (int xi = x_begin; xi < x_end; xi++){
+				const int x0 = 2*xi;
+				const int x1 = std::min(x0 + 1, finer.width_ - 1);
+				row[xi - x_begin] = std::max(std::max(finer.at(x0, y0), finer.at(x1, y0)),
+				                             std::max(finer.at(x0, y1), finer.at(x1, y1)));
+			}
+		}
 	}
 }
 
-void CellGrid::showGrid(amrl_msgs::VisualizationMsg &viz){
+void CellGrid::showGrid(amrl_msgs::VisualizationMsg &viz) const{
 	
 	int x_count = 0;
 	int y_count = 0;
@@ -124,23 +293,18 @@ void CellGrid::showGrid(amrl_msgs::VisualizationMsg &viz){
 			y_count = 0;
 
 			for (int yi = 0; yi < height_; yi++){
-				try{
-					Vector2f loc = getLoc(xi, yi);
-					float val = grid_[xi][yi];
+				Vector2f loc = getLoc(xi, yi);
+				float val = at(xi, yi);
 
-					if (y_count == 5){
-						y_count = 0;
+				if (y_count == 5){
+					y_count = 0;
 
-						if (val > 0.8*min_cost_){
-							visualization::DrawCross(loc, 0.1*(min_cost_ - val)/min_cost_, 0x000000, viz);
-						}
+					if (val > 0.8*min_cost_){
+						visualization::DrawCross(loc, 0.1*(min_cost_ - val)/min_cost_, 0x000000, viz);
 					}
-
-					y_count++;
-
-				}catch(std::out_of_range){
-					continue;
 				}
+
+				y_count++;
 			}
 		}
 		x_count++;
@@ -1,28 +1,96 @@
 #ifndef CELL_GRID_CS393_HH
 #define CELL_GRID_CS393_HH
 
+#include <stdint.h>
+
 #include <algorithm>
+#include <cmath>
+#include <memory>
 #include <vector>
 #include <array>
 
 #include "eigen3/Eigen/Dense"
 #include "eigen3/Eigen/Geometry"
+#include "eigen3/Eigen/StdVector"
 #include "amrl_msgs/VisualizationMsg.h"
 #include "visualization/visualization.h"
 
+// Raster of log-likelihoods. Cells are grouped into square tiles of
+// kTileSize x kTileSize, each stored contiguously, so that lookups of nearby
+// points touch the same cache lines. Tiles are reference counted and copied
+// on write: copies of a grid share their tiles until one of them writes a
+// tile, and tiles never written share one tile of min_cost_. Memory thus
+// grows with what was written and with how much copies differ, plus one
+// pointer per tile. Tiles written since the last clear are tracked, so that
+// clearing and pooling only cost as much as what was written.
+//
+// Copying a shared tile on write reads its reference count, which other grids
+// sharing it may change, so grids that share tiles must not be written from
+// different threads at once, unless makeWritable was first called for the
+// points each will be written with.
 class CellGrid{
+public:
+  static const int kTileBits = 3;
+  static const int kTileSize = 1 << kTileBits;   // Cells per tile side
+  static const int kTileArea = kTileSize * kTileSize;
+
 private:
+  struct alignas(16) Tile{
+    float cells[kTileArea];   // Row-major
+  };
+
   Eigen::Vector2f origin_;   // Location of the center of the lower left block
   float resolution_;         // Size of grid blocks in meters (grid blocks are square)
+  float inv_resolution_;     // Cells per meter
   int width_;                // Width of the grid in cells
   int height_;               // Height of the grid in cells
+  int x_tiles_;              // Width of the grid in tiles
   float min_cost_;           // Minimum allowable value of log-likelihood
 
-  std::vector< std::vector<float> > grid_;   // Grid of log-likelihoods
+  std::vector<std::shared_ptr<Tile> > tiles_;   // Row-major tiles of log-likelihoods
+  std::shared_ptr<Tile> empty_tile_;            // Tile of min_cost_ shared by all unwritten tiles
+  std::vector<uint8_t> tile_written_;   // Whether each tile was written since the last clear
+  std::vector<int> written_tiles_;      // Indices of those tiles, all other tiles are empty_tile_
+
+  std::vector<float> kernel_;   // Log-likelihoods around a laser point, row-major
+  int kernel_radius_;           // Half width of kernel_ in cells
+  float kernel_std_dev_;        // Standard deviation kernel_ was built for
+  float kernel_resolution_;     // Resolution kernel_ was built for
+  std::vector<float> distances_;   // Row-major squared distance transform scratch space
+
+  void buildKernel(float std_dev);
+  // Reset the whole grid to min_cost_
+  void reset();
+
+  // Index of a cell's tile in tiles_, and of the cell within the tile
+  int tileIndex(int xi, int yi) const {
+    return (yi >> kTileBits) * x_tiles_ + (xi >> kTileBits);
+  }
+  static int cellIndex(int xi, int yi) {
+    return ((yi & (kTileSize - 1)) << kTileBits) + (xi & (kTileSize - 1));
+  }
+  float cellValue(int xi, int yi) const {
+    return tiles_[tileIndex(xi, yi)]->cells[cellIndex(xi, yi)];
+  }
+
+  // Get a cell of a tile that is about to be written, giving the tile a copy
+  // of its own if it is shared. A tile only referenced by this grid cannot
+  // become shared meanwhile, since only copying the grid shares tiles.
+  float &writableValue(int xi, int yi) {
+    const int tile = tileIndex(xi, yi);
+    if (not tile_written_[tile]) {
+      tile_written_[tile] = 1;
+      written_tiles_.push_back(tile);
+    }
+    if (tiles_[tile].use_count() != 1) tiles_[tile] = std::make_shared<Tile>(*tiles_[tile]);
+    return tiles_[tile]->cells[cellIndex(xi, yi)];
+  }
 
 public:
   // Default Constructor
-  CellGrid(){}
+  CellGrid() : origin_(0, 0), resolution_(1), inv_resolution_(1), width_(0),
+               height_(0), x_tiles_(0), min_cost_(-1000), kernel_radius_(0),
+               kernel_std_dev_(0), kernel_resolution_(0) {}
   // Custom Constructor
   CellGrid(Eigen::Vector2f ORIGIN, float RES, float WIDTH, float HEIGHT);
 
@@ -33,23 +101,84 @@ public:
   int getYCellCount() const;
   float getWidth() const;
   float getHeight() const;
+  float getMinCost() const;
 
+  // Get the cell index of a location, throwing std::out_of_range outside the grid
   std::array<int,2> getIndex(Eigen::Vector2f loc) const;
   Eigen::Vector2f getLoc(int x, int y) const;
 
-  // Retrieve a grid value using a location
+  // Get the cell index of a location, returning false outside the grid
+  bool tryIndex(const Eigen::Vector2f& loc, int* xi, int* yi) const {
+    const float u = (loc.x() - origin_.x()) * inv_resolution_;
+    const float v = (loc.y() - origin_.y()) * inv_resolution_;
+    // Same truncation toward zero as getIndex
+    *xi = static_cast<int>(u);
+    *yi = static_cast<int>(v);
+    return checkXLim(*xi) and checkYLim(*yi);
+  }
+
+  // Get the cell index of a location, rounding down, whether or not it is inside the grid
+  Eigen::Vector2i floorIndex(const Eigen::Vector2f& loc) const {
+    return Eigen::Vector2i(static_cast<int>(std::floor((loc.x() - origin_.x()) * inv_resolution_)),
+                           static_cast<int>(std::floor((loc.y() - origin_.y()) * inv_resolution_)));
+  }
+
+  // Retrieve a grid value using a location, throwing std::out_of_range outside the grid
   float &atLoc(const Eigen::Vector2f loc);
 
-  // Retrieve a grid value using an index
-  std::vector<float> &operator [](int i);
+  // Retrieve a grid value using a location, returning false outside the grid
+  bool tryAt(const Eigen::Vector2f& loc, float* value) const {
+    int xi, yi;
+    if (not tryIndex(loc, &xi, &yi)) return false;
+    *value = cellValue(xi, yi);
+    return true;
+  }
+
+  // Retrieve the value of the cell nearest to a location, inside or outside the grid
+  float atClamped(const Eigen::Vector2f& loc) const {
+    const int xi = std::min(width_ - 1, std::max(0, static_cast<int>(
+        (loc.x() - origin_.x()) * inv_resolution_)));
+    const int yi = std::min(height_ - 1, std::max(0, static_cast<int>(
+        (loc.y() - origin_.y()) * inv_resolution_)));
+    return cellValue(xi, yi);
+  }
+
+  // Look up the values at many locations at once, using outside_value for
+  // locations outside the grid.
+  void gather(const Eigen::Vector2f* locs, size_t n, float outside_value, float* values) const;
+
+  // Bicubic interpolation of the values, taken to be at the cell centers, and
+  // its gradient. Cells outside the grid take the value of the nearest cell.
+  float interpolate(const Eigen::Vector2f& loc, Eigen::Vector2f* gradient) const;
+
+  // Retrieve a grid value using an index, which must be within the grid. The
+  // reference is valid until the grid is next written, cleared or copied.
+  float &at(int xi, int yi) { return writableValue(xi, yi); }
+  float at(int xi, int yi) const { return cellValue(xi, yi); }
+  // Retrieve a grid value using an index, with a fixed value outside the grid
+  float atOr(int xi, int yi, float outside_value) const {
+    return (checkXLim(xi) and checkYLim(yi)) ? cellValue(xi, yi) : outside_value;
+  }
 
   // Check if a cell is within grid boundaries
-  bool checkXLim(int xi) const;
-  bool checkYLim(int yi) const;
+  bool checkXLim(int xi) const {return(xi >= 0 and xi < width_);}
+  bool checkYLim(int yi) const {return(yi >= 0 and yi < height_);}
 
+  // Reset the tiles written since the last clear to min_cost_, releasing them
   void clear();
-  void applyLaserPoint(Eigen::Vector2f loc, float std_dev); 
-  void showGrid(amrl_msgs::VisualizationMsg &viz);
+  // Number of tiles that are not shared with any other grid
+  int countUniqueTiles() const;
+  // Raise cells near a laser point to its Gaussian log-likelihood
+  void applyLaserPoint(Eigen::Vector2f loc, float std_dev);
+  // Same as applyLaserPoint for every point, using a distance transform of the whole grid
+  void applyLaserPoints(const std::vector<Eigen::Vector2f> &points, float std_dev);
+  // Give the grid its own copy of every tile that applyLaserPoint or
+  // applyLaserPoints could write for these points, so that writing them
+  // copies nothing
+  void makeWritable(const std::vector<Eigen::Vector2f> &points, float std_dev);
+  // Build the next, half resolution, level of a max-pooled pyramid
+  void maxPoolFrom(const CellGrid &finer);
+  void showGrid(amrl_msgs::VisualizationMsg &viz) const;
 };
 
 #endif
@@ -0,0 +1,285 @@
+//========================================================================
+//  This software is free: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License Version 3,
+//  as published by the Free Software Foundation.
+//
+//  This software is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  Version 3 in the file COPYING that came with this distribution.
+//  If not, see <http://www.gnu.org/licenses/>.
+//========================================================================
+/*!
+\file    map_file.cc
+\brief   Chunked binary file of SLAM keyframes and map cells, appended to
+         on a background thread and memory-mapped at load.
+*/
+//========================================================================
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "map_file.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+const char kMagic[8] = {'S', 'L', 'A', 'M', 'M', 'A', 'P', '\0'};
+const uint32_t kVersion = 1;
+
+size_t PaddedSize(size_t size) {
+  return (size + 7) & ~static_cast<size_t>(7);
+}
+}  // namespace
+
+namespace slam {
+
+MapFile::MapFile() :
+    mapping_(NULL),
+    mapping_size_(0),
+    valid_size_(0),
+    map_cells_(NULL),
+    keyframes_before_map_cells_(0) {}
+
+MapFile::~MapFile() {
+  Unload();
+}
+
+bool MapFile::Load(const string& file) {
+  Unload();
+  const int fd = open(file.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 ||
+      static_cast<size_t>(file_stat.st_size) < sizeof(MapFileHeader)) {
+    close(fd);
+    return false;
+  }
+  const size_t size = file_stat.st_size;
+  void* mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  // The mapping stays valid after the descriptor is closed.
+  close(fd);
+  if (mapping == MAP_FAILED) return false;
+
+  const char* data = static_cast<const char*>(mapping);
+  const MapFileHeader* header = reinterpret_cast<const MapFileHeader*>(data);
+  if (memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 ||
+      header->version != kVersion) {
+    fprintf(stderr, "ERROR: %s is not a version %u map file\n",
+            file.c_str(), kVersion);
+    munmap(mapping, size);
+    return false;
+  }
+
+  mapping_ = mapping;
+  mapping_size_ = size;
+  size_t offset = sizeof(MapFileHeader);
+  while (offset + sizeof(MapChunkHeader) <= size) {
+    const MapChunkHeader* chunk =
+        reinterpret_cast<const MapChunkHeader*>(data + offset);
+    const size_t payload = offset + sizeof(MapChunkHeader);
+    if (chunk->size % 8 != 0 || chunk->size > size - payload) break;
+    if (chunk->type == kKeyframeChunk) {
+      const KeyframeRecord* keyframe =
+          reinterpret_cast<const KeyframeRecord*>(data + payload);
+      if (chunk->size < sizeof(KeyframeRecord) ||
+          (chunk->size - sizeof(KeyframeRecord)) / sizeof(float) <
+              keyframe->num_ranges) {
+        break;
+      }
+      keyframes_.push_back(keyframe);
+    } else if (chunk->type == kMapCellsChunk) {
+      const MapCellsRecord* map_cells =
+          reinterpret_cast<const MapCellsRecord*>(data + payload);
+      if (chunk->size < sizeof(MapCellsRecord) ||
+          (chunk->size - sizeof(MapCellsRecord)) / sizeof(MapCellRecord) <
+              map_cells->num_cells) {
+        break;
+      }
+      map_cells_ = map_cells;
+      keyframes_before_map_cells_ = keyframes_.size();
+    } else if (chunk->type == kKeyframePosesChunk) {
+      const KeyframePosesRecord* keyframe_poses =
+          reinterpret_cast<const KeyframePosesRecord*>(data + payload);
+      if (chunk->size < sizeof(KeyframePosesRecord) ||
+          (chunk->size - sizeof(KeyframePosesRecord)) /
+              sizeof(KeyframePoseRecord) < keyframe_poses->num_poses) {
+        break;
+      }
+      keyframe_poses_.push_back(keyframe_poses);
+    }
+    offset = payload + chunk->size;
+  }
+  valid_size_ = offset;
+  return true;
+}
+
+void MapFile::Unload() {
+  if (mapping_ != NULL) munmap(mapping_, mapping_size_);
+  mapping_ = NULL;
+  mapping_size_ = 0;
+  valid_size_ = 0;
+  keyframes_.clear();
+  map_cells_ = NULL;
+  keyframes_before_map_cells_ = 0;
+  keyframe_poses_.clear();
+}
+
+const KeyframeRecord& MapFile::GetKeyframe(size_t i,
+                                           const float** ranges) const {
+  *ranges = reinterpret_cast<const float*>(keyframes_[i] + 1);
+  return *keyframes_[i];
+}
+
+const MapCellsRecord* MapFile::GetMapCells(
+    const MapCellRecord** cells, size_t* num_keyframes_before) const {
+  *num_keyframes_before = keyframes_before_map_cells_;
+  *cells = (map_cells_ == NULL) ?
+      NULL : reinterpret_cast<const MapCellRecord*>(map_cells_ + 1);
+  return map_cells_;
+}
+
+const KeyframePosesRecord& MapFile::GetKeyframePoses(
+    size_t i, const KeyframePoseRecord** poses) const {
+  *poses = reinterpret_cast<const KeyframePoseRecord*>(keyframe_poses_[i] + 1);
+  return *keyframe_poses_[i];
+}
+
+MapFileWriter::MapFileWriter() : file_(NULL), closing_(false) {}
+
+MapFileWriter::~MapFileWriter() {
+  Close();
+}
+
+bool MapFileWriter::Open(const string& file) {
+  Close();
+  FILE* fid = NULL;
+  struct stat file_stat;
+  if (stat(file.c_str(), &file_stat) == 0 && file_stat.st_size > 0) {
+    // Append after the last complete chunk of an existing map file, dropping
+    // anything a crash left behind it. Any other file is left alone.
+    size_t valid_size = 0;
+    {
+      MapFile existing;
+      if (!existing.Load(file)) {
+        fprintf(stderr, "ERROR: %s exists and is not a map file, not "
+                "overwriting it\n", file.c_str());
+        return false;
+      }
+      valid_size = existing.ValidSize();
+    }
+    if (truncate(file.c_str(), valid_size) == 0) {
+      fid = fopen(file.c_str(), "ab");
+    }
+  } else {
+    fid = fopen(file.c_str(), "wb");
+    if (fid != NULL) {
+      MapFileHeader header;
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, kMagic, sizeof(kMagic));
+      header.version = kVersion;
+      if (fwrite(&header, sizeof(header), 1, fid) != 1 || fflush(fid) != 0) {
+        fclose(fid);
+        remove(file.c_str());
+        fid = NULL;
+      }
+    }
+  }
+  if (fid == NULL) {
+    fprintf(stderr, "ERROR: Unable to write map file %s\n", file.c_str());
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  file_ = fid;
+  closing_ = false;
+  thread_ = std::thread(&MapFileWriter::Run, this);
+  return true;
+}
+
+void MapFileWriter::Close() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (file_ == NULL) return;
+    closing_ = true;
+  }
+  chunks_cv_.notify_one();
+  thread_.join();
+  std::lock_guard<std::mutex> lock(mutex_);
+  fclose(file_);
+  file_ = NULL;
+}
+
+bool MapFileWriter::IsOpen() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return file_ != NULL && !closing_;
+}
+
+void MapFileWriter::WriteKeyframe(const KeyframeRecord& keyframe,
+                                  const float* ranges) {
+  QueueChunk(kKeyframeChunk, &keyframe, sizeof(keyframe),
+             ranges, keyframe.num_ranges * sizeof(float));
+}
+
+void MapFileWriter::WriteMapCells(const MapCellsRecord& map_cells,
+                                  const MapCellRecord* cells) {
+  QueueChunk(kMapCellsChunk, &map_cells, sizeof(map_cells),
+             cells, map_cells.num_cells * sizeof(MapCellRecord));
+}
+
+void MapFileWriter::WriteKeyframePoses(
+    const KeyframePosesRecord& keyframe_poses,
+    const KeyframePoseRecord* poses) {
+  QueueChunk(kKeyframePosesChunk, &keyframe_poses, sizeof(keyframe_poses),
+             poses, keyframe_poses.num_poses * sizeof(KeyframePoseRecord));
+}
+
+void MapFileWriter::QueueChunk(uint32_t type,
+                               const void* record,
+                               size_t record_size,
+                               const void* data,
+                               size_t data_size) {
+  MapChunkHeader header;
+  header.type = type;
+  header.size = PaddedSize(record_size + data_size);
+  vector<char> chunk(sizeof(header) + header.size, 0);
+  memcpy(chunk.data(), &header, sizeof(header));
+  memcpy(chunk.data() + sizeof(header), record, record_size);
+  if (data_size > 0) {
+    memcpy(chunk.data() + sizeof(header) + record_size, data, data_size);
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (file_ == NULL || closing_) return;
+    chunks_.push_back(std::move(chunk));
+  }
+  chunks_cv_.notify_one();
+}
+
+// Write queued chunks until closed, then write what is left
+void MapFileWriter::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    chunks_cv_.wait(lock, [this] { return closing_ || !chunks_.empty(); });
+    if (chunks_.empty()) break;
+    const vector<char> chunk = std::move(chunks_.front());
+    chunks_.pop_front();
+    lock.unlock();
+    // Flushed chunk by chunk, so that a crash loses at most the last one.
+    fwrite(chunk.data(), 1, chunk.size(), file_);
+    fflush(file_);
+    lock.lock();
+  }
+}
+
+}  // namespace slam
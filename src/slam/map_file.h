@@ -0,0 +1,190 @@
+//========================================================================
+//  This software is free: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License Version 3,
+//  as published by the Free Software Foundation.
+//
+//  This software is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  Version 3 in the file COPYING that came with this distribution.
+//  If not, see <http://www.gnu.org/licenses/>.
+//========================================================================
+/*!
+\file    map_file.h
+\brief   Chunked binary file of SLAM keyframes and map cells, appended to
+         on a background thread and memory-mapped at load.
+*/
+//========================================================================
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef SRC_SLAM_MAP_FILE_H_
+#define SRC_SLAM_MAP_FILE_H_
+
+namespace slam {
+
+// File layout: one MapFileHeader, followed by chunks. Each chunk is a
+// MapChunkHeader followed by size bytes of payload, padded to a multiple of
+// 8 bytes so that every record in the mapped file is aligned. Readers skip
+// chunk types they do not know, and stop at a chunk cut short by a crash.
+struct MapFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+};
+
+struct MapChunkHeader {
+  uint32_t type;
+  uint32_t size;
+};
+
+enum MapChunkType {
+  // A KeyframeRecord followed by num_ranges floats.
+  kKeyframeChunk = 1,
+  // A MapCellsRecord followed by num_cells MapCellRecords, the whole map as
+  // of the keyframes before it in the file.
+  kMapCellsChunk = 2,
+  // A KeyframePosesRecord followed by num_poses KeyframePoseRecords, new
+  // poses of the keyframes from first on, which replace the poses of their
+  // keyframe records and of earlier keyframe poses chunks.
+  kKeyframePosesChunk = 3,
+};
+
+struct KeyframeRecord {
+  float x;
+  float y;
+  float angle;
+  float range_min;
+  float range_max;
+  float angle_min;
+  float angle_max;
+  uint32_t num_ranges;
+};
+
+struct MapCellsRecord {
+  float resolution;
+  uint32_t num_cells;
+};
+
+struct KeyframePosesRecord {
+  uint32_t first;
+  uint32_t num_poses;
+};
+
+struct KeyframePoseRecord {
+  float x;
+  float y;
+  float angle;
+};
+
+struct MapCellRecord {
+  uint64_t key;
+  float sum_x;
+  float sum_y;
+  int32_t hits;
+  uint32_t reserved;
+};
+
+// Read-only view of a map file.
+class MapFile {
+ public:
+  MapFile();
+  ~MapFile();
+
+  // Memory-map a map file and index its chunks. Returns false, leaving the
+  // file unloaded, if it is missing or is not a map file.
+  bool Load(const std::string& file);
+
+  // Release the mapping.
+  void Unload();
+
+  size_t NumKeyframes() const { return keyframes_.size(); }
+  // The record of a keyframe, and its ranges in ranges[0, num_ranges).
+  const KeyframeRecord& GetKeyframe(size_t i, const float** ranges) const;
+
+  // The last map cells chunk, or NULL if there is none, and the number of
+  // keyframes before it.
+  const MapCellsRecord* GetMapCells(const MapCellRecord** cells,
+                                    size_t* num_keyframes_before) const;
+
+  size_t NumKeyframePoses() const { return keyframe_poses_.size(); }
+  // The record of a keyframe poses chunk, in file order, and its poses in
+  // poses[0, num_poses).
+  const KeyframePosesRecord& GetKeyframePoses(
+      size_t i, const KeyframePoseRecord** poses) const;
+
+  // Bytes up to the end of the last complete chunk.
+  size_t ValidSize() const { return valid_size_; }
+
+ private:
+  // Disable copy constructor and assignment, the file owns its mapping.
+  MapFile(const MapFile&);
+  void operator=(const MapFile&);
+
+  void* mapping_;
+  size_t mapping_size_;
+  size_t valid_size_;
+  std::vector<const KeyframeRecord*> keyframes_;
+  const MapCellsRecord* map_cells_;
+  size_t keyframes_before_map_cells_;
+  std::vector<const KeyframePosesRecord*> keyframe_poses_;
+};
+
+// Appends chunks to a map file. The Write calls only copy the data and queue
+// it, the file is written by a thread owned by the writer. Write calls may
+// come from any thread.
+class MapFileWriter {
+ public:
+  MapFileWriter();
+  ~MapFileWriter();
+
+  // Open a map file for writing, appending to it if it already is a map file
+  // and creating it if it is missing or empty. Returns false if it cannot be
+  // written, or if it is some other file, which is left unchanged.
+  bool Open(const std::string& file);
+
+  // Write everything queued and close the file.
+  void Close();
+
+  bool IsOpen();
+
+  void WriteKeyframe(const KeyframeRecord& keyframe, const float* ranges);
+  void WriteMapCells(const MapCellsRecord& map_cells,
+                     const MapCellRecord* cells);
+  void WriteKeyframePoses(const KeyframePosesRecord& keyframe_poses,
+                          const KeyframePoseRecord* poses);
+
+ private:
+  // Disable copy constructor and assignment, the writer owns its thread.
+  MapFileWriter(const MapFileWriter&);
+  void operator=(const MapFileWriter&);
+
+  void QueueChunk(uint32_t type,
+                  const void* record,
+                  size_t record_size,
+                  const void* data,
+                  size_t data_size);
+  void Run();
+
+  FILE* file_;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable chunks_cv_;
+  std::deque<std::vector<char> > chunks_;
+  bool closing_;
+};
+
+}  // namespace slam
+
+#endif  // SRC_SLAM_MAP_FILE_H_
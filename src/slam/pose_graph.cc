@@ -0,0 +1,186 @@
+//========================================================================
+//  This software is free: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License Version 3,
+//  as published by the Free Software Foundation.
+//
+//  This software is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  Version 3 in the file COPYING that came with this distribution.
+//  If not, see <http://www.gnu.org/licenses/>.
+//========================================================================
+/*!
+\file    pose_graph.cc
+\brief   Graph of 2D keyframe poses and relative pose constraints between
+         them, optimized over a window of its newest nodes.
+*/
+//========================================================================
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "eigen3/Eigen/Dense"
+#include "eigen3/Eigen/Sparse"
+#include "eigen3/Eigen/SparseCholesky"
+#include "shared/math/math_util.h"
+
+#include "pose_graph.h"
+
+using Eigen::Matrix2d;
+using Eigen::Matrix3d;
+using Eigen::Vector2d;
+using Eigen::Vector3d;
+using Eigen::Vector3f;
+using math_util::AngleMod;
+using std::vector;
+
+namespace {
+const double kConvergedStep = 1e-6;
+}  // namespace
+
+namespace slam {
+
+void PoseGraph::Clear() {
+  nodes_.clear();
+  edges_.clear();
+  node_edges_.clear();
+}
+
+int PoseGraph::AddNode(const Vector3f& pose) {
+  nodes_.push_back(pose);
+  node_edges_.push_back(vector<int>());
+  return nodes_.size() - 1;
+}
+
+void PoseGraph::AddEdge(int from, int to,
+                        const Vector3f& measurement,
+                        const Eigen::Matrix3f& information) {
+  const PoseGraphEdge edge = {from, to, measurement, information};
+  edges_.push_back(edge);
+  node_edges_[from].push_back(edges_.size() - 1);
+  node_edges_[to].push_back(edges_.size() - 1);
+}
+
+Vector3f PoseGraph::RelativePose(const Vector3f& from, const Vector3f& to) {
+  const Eigen::Rotation2Df R_map2from(-from.z());
+  const Eigen::Vector2f loc = R_map2from * (to.head<2>() - from.head<2>());
+  return Vector3f(loc.x(), loc.y(), AngleMod(to.z() - from.z()));
+}
+
+// Each edge's error is the measurement's deviation from the relative pose of
+// its nodes, in the frame of node from. The normal equations are built over
+// the window's nodes only, as 3x3 blocks, and solved by sparse Cholesky.
+// Edges to nodes before the window treat those nodes as constants.
+bool PoseGraph::Optimize(int first, int max_iterations) {
+  const int num_nodes = nodes_.size();
+  first = std::max(first, 1);
+  if (first >= num_nodes) return false;
+  const int num_variables = 3 * (num_nodes - first);
+
+  // Edges with a node in the window, each listed once, at its newer node
+  vector<int> window_edges;
+  for (int i = first; i < num_nodes; ++i) {
+    for (const int e : node_edges_[i]) {
+      if (std::max(edges_[e].from, edges_[e].to) == i) {
+        window_edges.push_back(e);
+      }
+    }
+  }
+
+  vector<Vector3d> poses(num_nodes - first);
+  for (int i = first; i < num_nodes; ++i) {
+    poses[i - first] = nodes_[i].cast<double>();
+  }
+  auto pose = [&](int i) -> Vector3d {
+    return (i < first) ? Vector3d(nodes_[i].cast<double>()) : poses[i - first];
+  };
+
+  Eigen::SimplicialLDLT<Eigen::SparseMatrix<double> > solver;
+  Eigen::SparseMatrix<double> H(num_variables, num_variables);
+  Eigen::VectorXd b(num_variables);
+  vector<Eigen::Triplet<double> > triplets;
+  bool analyzed = false;
+  for (int iteration = 0; iteration < max_iterations; ++iteration) {
+    triplets.clear();
+    b.setZero();
+    auto add_block = [&](int row, int col, const Matrix3d& block) {
+      for (int r = 0; r < 3; ++r) {
+        for (int c = 0; c < 3; ++c) {
+          triplets.push_back(Eigen::Triplet<double>(3 * row + r, 3 * col + c,
+                                                    block(r, c)));
+        }
+      }
+    };
+    for (const int e : window_edges) {
+      const PoseGraphEdge& edge = edges_[e];
+      const Vector3d x_from = pose(edge.from);
+      const Vector3d x_to = pose(edge.to);
+      const double c = cos(x_from.z());
+      const double s = sin(x_from.z());
+      Matrix2d R_map2from;
+      R_map2from << c, s, -s, c;
+      Matrix2d dR_map2from;
+      dR_map2from << -s, c, -c, -s;
+      const Vector2d translation = x_to.head<2>() - x_from.head<2>();
+
+      Vector3d error;
+      error.head<2>() = R_map2from * translation -
+          edge.measurement.head<2>().cast<double>();
+      error.z() = AngleMod(x_to.z() - x_from.z() -
+                           static_cast<double>(edge.measurement.z()));
+
+      // Jacobians of the error by the from and to poses
+      Matrix3d A = Matrix3d::Zero();
+      A.block<2, 2>(0, 0) = -R_map2from;
+      A.block<2, 1>(0, 2) = dR_map2from * translation;
+      A(2, 2) = -1;
+      Matrix3d B = Matrix3d::Zero();
+      B.block<2, 2>(0, 0) = R_map2from;
+      B(2, 2) = 1;
+
+      const Matrix3d information = edge.information.cast<double>();
+      const int i = edge.from - first;
+      const int j = edge.to - first;
+      if (i >= 0) {
+        add_block(i, i, A.transpose() * information * A);
+        b.segment<3>(3 * i) += A.transpose() * information * error;
+      }
+      if (j >= 0) {
+        add_block(j, j, B.transpose() * information * B);
+        b.segment<3>(3 * j) += B.transpose() * information * error;
+      }
+      if (i >= 0 && j >= 0) {
+        const Matrix3d H_ij = A.transpose() * information * B;
+        add_block(i, j, H_ij);
+        add_block(j, i, H_ij.transpose());
+      }
+    }
+    H.setFromTriplets(triplets.begin(), triplets.end());
+
+    // The sparsity pattern is the same every iteration
+    if (!analyzed) {
+      solver.analyzePattern(H);
+      analyzed = true;
+    }
+    solver.factorize(H);
+    if (solver.info() != Eigen::Success) return false;
+    const Eigen::VectorXd step = solver.solve(-b);
+    if (solver.info() != Eigen::Success || !step.allFinite()) return false;
+    for (size_t k = 0; k < poses.size(); ++k) {
+      poses[k] += step.segment<3>(3 * k);
+      poses[k].z() = AngleMod(poses[k].z());
+    }
+    if (step.lpNorm<Eigen::Infinity>() < kConvergedStep) break;
+  }
+
+  for (int i = first; i < num_nodes; ++i) {
+    nodes_[i] = poses[i - first].cast<float>();
+  }
+  return true;
+}
+
+}  // namespace slam
@@ -0,0 +1,80 @@
+//========================================================================
+//  This software is free: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License Version 3,
+//  as published by the Free Software Foundation.
+//
+//  This software is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  Version 3 in the file COPYING that came with this distribution.
+//  If not, see <http://www.gnu.org/licenses/>.
+//========================================================================
+/*!
+\file    pose_graph.h
+\brief   Graph of 2D keyframe poses and relative pose constraints between
+         them, optimized over a window of its newest nodes.
+*/
+//========================================================================
+
+#include <vector>
+
+#include "eigen3/Eigen/Dense"
+
+#ifndef SRC_SLAM_POSE_GRAPH_H_
+#define SRC_SLAM_POSE_GRAPH_H_
+
+namespace slam {
+
+// Poses are (x, y, angle) in the map frame.
+struct PoseGraphEdge {
+  int from;
+  int to;
+  // Pose of node to in the frame of node from.
+  Eigen::Vector3f measurement;
+  // Inverse of the measurement's covariance, in the frame of node from.
+  Eigen::Matrix3f information;
+};
+
+class PoseGraph {
+ public:
+  PoseGraph() {}
+
+  // Remove all nodes and edges.
+  void Clear();
+
+  size_t NumNodes() const { return nodes_.size(); }
+  size_t NumEdges() const { return edges_.size(); }
+
+  // Add a node, returning its index.
+  int AddNode(const Eigen::Vector3f& pose);
+  const Eigen::Vector3f& GetNode(int i) const { return nodes_[i]; }
+  void SetNode(int i, const Eigen::Vector3f& pose) { nodes_[i] = pose; }
+
+  // Add a constraint between two existing nodes.
+  void AddEdge(int from, int to,
+               const Eigen::Vector3f& measurement,
+               const Eigen::Matrix3f& information);
+
+  // Pose of to in the frame of from.
+  static Eigen::Vector3f RelativePose(const Eigen::Vector3f& from,
+                                      const Eigen::Vector3f& to);
+
+  // Gauss-Newton on the nodes from first on, holding the older nodes fixed,
+  // or node 0 if first is 0. Only the edges of the nodes being optimized are
+  // visited, so the cost depends on the size of the window, not of the
+  // graph. Returns false, leaving the nodes unchanged, if the window is not
+  // constrained.
+  bool Optimize(int first, int max_iterations);
+
+ private:
+  std::vector<Eigen::Vector3f> nodes_;
+  std::vector<PoseGraphEdge> edges_;
+  std::vector<std::vector<int> > node_edges_;   // Edges of each node
+};
+
+}  // namespace slam
+
+#endif  // SRC_SLAM_POSE_GRAPH_H_
@@ -0,0 +1,92 @@
+//========================================================================
+//  This software is free: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License Version 3,
+//  as published by the Free Software Foundation.
+//
+//  This software is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  Version 3 in the file COPYING that came with this distribution.
+//  If not, see <http://www.gnu.org/licenses/>.
+//========================================================================
+/*!
+\file    scan_descriptor.cc
+\brief   Compact descriptors of laser scans, for finding keyframes taken at
+         the same place without matching their scans.
+*/
+//========================================================================
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "scan_descriptor.h"
+
+using std::pair;
+using std::vector;
+
+namespace slam {
+
+ScanDescriptorIndex::ScanDescriptorIndex(float max_range) :
+    bins_per_meter_(kBins / max_range) {}
+
+void ScanDescriptorIndex::Clear() {
+  descriptors_.clear();
+}
+
+int ScanDescriptorIndex::Add(const vector<float>& ranges,
+                             float range_min,
+                             float range_max) {
+  int counts[kBins] = {0};
+  int num_counted = 0;
+  for (const float range : ranges) {
+    if (range <= range_min || range >= range_max) continue;
+    const int bin = static_cast<int>(range * bins_per_meter_);
+    if (bin >= kBins) continue;
+    ++counts[bin];
+    ++num_counted;
+  }
+  const size_t first = descriptors_.size();
+  descriptors_.resize(first + kBins, 0);
+  for (int b = 0; b < kBins && num_counted > 0; ++b) {
+    descriptors_[first + b] = static_cast<uint8_t>(
+        std::min(255, (255 * counts[b] + num_counted / 2) / num_counted));
+  }
+  return first / kBins;
+}
+
+int ScanDescriptorIndex::Distance(int i, int j) const {
+  const uint8_t* a = &descriptors_[i * kBins];
+  const uint8_t* b = &descriptors_[j * kBins];
+  int distance = 0;
+  for (int k = 0; k < kBins; ++k) {
+    distance += abs(static_cast<int>(a[k]) - static_cast<int>(b[k]));
+  }
+  return distance;
+}
+
+// The neighbors are kept sorted, so each descriptor costs its distance and,
+// only when it is among the closest so far, an insertion into k entries.
+void ScanDescriptorIndex::Search(int i, int num_searched, int k,
+                                 vector<pair<int, int> >* neighbors) const {
+  neighbors->clear();
+  if (k <= 0) return;
+  num_searched = std::min(num_searched, static_cast<int>(Size()));
+  for (int j = 0; j < num_searched; ++j) {
+    const pair<int, int> neighbor(Distance(i, j), j);
+    if (static_cast<int>(neighbors->size()) == k) {
+      if (!(neighbor < neighbors->back())) continue;
+      neighbors->pop_back();
+    }
+    neighbors->insert(std::upper_bound(neighbors->begin(), neighbors->end(),
+                                       neighbor),
+                      neighbor);
+  }
+}
+
+}  // namespace slam
@@ -0,0 +1,66 @@
+//========================================================================
+//  This software is free: you can redistribute it and/or modify
+//  it under the terms of the GNU Lesser General Public License Version 3,
+//  as published by the Free Software Foundation.
+//
+//  This software is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public License
+//  Version 3 in the file COPYING that came with this distribution.
+//  If not, see <http://www.gnu.org/licenses/>.
+//========================================================================
+/*!
+\file    scan_descriptor.h
+\brief   Compact descriptors of laser scans, for finding keyframes taken at
+         the same place without matching their scans.
+*/
+//========================================================================
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <utility>
+#include <vector>
+
+#ifndef SRC_SLAM_SCAN_DESCRIPTOR_H_
+#define SRC_SLAM_SCAN_DESCRIPTOR_H_
+
+namespace slam {
+
+// A scan's descriptor is the histogram of its ranges, in kBins bins of equal
+// width up to max_range, scaled so that the bins sum to about 255. It does
+// not depend on the heading of the scan within the field of view of the
+// sensor. Descriptors are stored one after the other in one buffer and
+// searched linearly, which is a few microseconds per thousand scans.
+class ScanDescriptorIndex {
+ public:
+  static const int kBins = 32;
+
+  explicit ScanDescriptorIndex(float max_range);
+
+  void Clear();
+  size_t Size() const { return descriptors_.size() / kBins; }
+
+  // Add the descriptor of a scan, returning its index. Readings at or beyond
+  // the limits of the sensor are left out.
+  int Add(const std::vector<float>& ranges, float range_min, float range_max);
+
+  // L1 distance between two descriptors.
+  int Distance(int i, int j) const;
+
+  // The k descriptors among [0, num_searched) closest to descriptor i, as
+  // (distance, index), closest first.
+  void Search(int i, int num_searched, int k,
+              std::vector<std::pair<int, int> >* neighbors) const;
+
+ private:
+  float bins_per_meter_;
+  std::vector<uint8_t> descriptors_;   // kBins per scan
+};
+
+}  // namespace slam
+
+#endif  // SRC_SLAM_SCAN_DESCRIPTOR_H_
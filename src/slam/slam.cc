@@ -19,9 +19,13 @@
 */
 //========================================================================
 
+#include <stdio.h>
+
 #include <algorithm>
 #include <cmath>
 #include <iostream>
+#include <string>
+#include <thread>
 #include "eigen3/Eigen/Dense"
 #include "eigen3/Eigen/Geometry"
 #include "gflags/gflags.h"
@@ -38,6 +42,7 @@ using namespace math_util;
 using math_util::AngleDiff;
 using math_util::RadToDeg;
 using Eigen::Affine2f;
+using Eigen::Matrix3f;
 using Eigen::Rotation2Df;
 using Eigen::Translation2f;
 using Eigen::Vector2f;
@@ -70,39 +75,128 @@ void trimScan(vector<Vector2f>* cloud, int offset_count){
 
 namespace slam {
 
+namespace {
+// Print backend progress (matches and loop closures) to stdout
+const bool kDebug = false;
+
+// Cell coordinates packed into one integer, x in the high 32 bits
+uint64_t CellKey(const Vector2f &loc, float resolution) {
+	const int32_t xi = static_cast<int32_t>(floor(loc.x() / resolution));
+	const int32_t yi = static_cast<int32_t>(floor(loc.y() / resolution));
+	return (static_cast<uint64_t>(static_cast<uint32_t>(xi)) << 32) | static_cast<uint32_t>(yi);
+}
+
+Vector3f PoseVector(const Pose &pose) {
+	return Vector3f(pose.loc.x(), pose.loc.y(), pose.angle);
+}
+}  // namespace
+
 SLAM::SLAM() :
 		/* Tuning Parameters */
 		observation_likelihood_res_(0.02),			// cell size of the lookup table (meters)
 		observation_likelihood_std_dev_(0.01),		// standard deviation of a laser scan position
+		distance_transform_table_(false),			// build the lookup table with a distance transform instead of stamping each point
 		motion_model_weight_(1.0),					// motion model weight
 		laser_scan_weight_(3.0),					// observation likelihood weight
 		CSM_scan_offset_(10),						// how many scans to skip in CSM 
-		x_res_(11.0),								// resolution of the motion model in x
-		y_res_(9.0),								// resolution of the motion model in y
-		t_res_(31.0),								// resolution of the motion model in theta
+		branch_and_bound_CSM_(false),				// search CSM candidates by branch and bound instead of exhaustively (faster for wide windows)
+		CSM_num_threads_(std::max(1u, std::thread::hardware_concurrency())),	// worker threads for scoring CSM candidates
+		CSM_pyramid_levels_(6),						// max-pooled levels above the lookup table, the coarsest has cells of 2^6 x 2^6
+		refine_CSM_(true),							// refine the CSM pose off the lattice of candidates
+		refine_iterations_(10),						// maximum Levenberg-Marquardt iterations of the refinement
+		refine_scan_offset_(4),						// how many scans to skip in the refinement
+		refine_loss_scale_(3.0),					// distance, in laser standard deviations, beyond which a scan point's pull on the refinement fades
+		x_res_(5.0),								// resolution of the motion model in x
+		y_res_(5.0),								// resolution of the motion model in y
+		t_res_(11.0),								// resolution of the motion model in theta
 		k1_(0.8),									// translation error per unit translation
 		k2_(0.5),									// translation error per unit rotation 
 		k3_(0.1),									// angular error per unit translation
 		k4_(2.0),									// angular error per unit rotation
 		linear_diff_threshold_(0.15),				// minimum distance to travel before applying CSM (meters)
 		angular_diff_threshold_(M_PI/24),			// minimum angular offset before applying CSM (radians)
+		max_queued_keyframes_(2),					// keyframes waiting for the backend, the oldest is dropped beyond this
+		map_res_(0.05),								// cell size of the map (meters)
+		map_min_hits_(1),							// laser hits for a map cell to count as occupied
+		submap_keyframes_(10),						// keyframes in a submap before it is frozen, a new one is started every half of this
+		submap_range_(4.0),							// distance from the start of a submap at which it is frozen (meters)
+		submap_size_(16.0),							// side of the square submap grids, centered on their first keyframe (meters)
+		CSM_min_translation_std_dev_(0.02),			// least standard deviation of a CSM translation given to the pose graph (meters)
+		CSM_min_angle_std_dev_(0.01),				// least standard deviation of a CSM angle given to the pose graph (radians)
+		loop_closure_(true),						// match keyframes against older keyframes near them to close loops
+		loop_closure_radius_(2.0),					// distance within which older keyframes are loop closure candidates (meters)
+		descriptor_max_range_(10.0),				// ranges binned into keyframe scan descriptors (meters)
+		loop_closure_descriptor_candidates_(3),		// keyframes with the most similar scan descriptors tried as loop closure candidates
+		loop_closure_max_descriptor_distance_(60),	// L1 distance between scan descriptors, out of 510, beyond which keyframes are not candidates
+		loop_closure_max_distance_(10.0),			// distance beyond which keyframes with similar scans are not candidates, the most drift expected (meters)
+		loop_closure_min_separation_(30),			// keyframes between a loop closure candidate and the current keyframe
+		loop_closure_interval_(5),					// keyframes between loop closure attempts
+		loop_closure_neighbors_(2),					// keyframes on each side of a candidate added to its grid
+		loop_closure_window_xy_(1.0),				// half width of the loop closure search in x and y (meters)
+		loop_closure_window_angle_(0.3),			// half width of the loop closure search in theta (radians)
+		loop_closure_lattice_xy_(0.1),				// spacing of the loop closure candidates in x and y (meters)
+		loop_closure_lattice_angle_(0.05),			// spacing of the loop closure candidates in theta (radians)
+		loop_closure_inlier_cost_(-25.0),			// lookup table value above which a scan point matches, 5 standard deviations
+		loop_closure_min_inliers_(0.6),				// fraction of matching scan points needed to close a loop
+		pose_graph_window_(200),					// newest keyframes optimized after a loop closure, older ones are held fixed
+		pose_graph_iterations_(5),					// Gauss-Newton iterations of the pose graph optimization
+		rbpf_particles_(0),							// map hypotheses of the Rao-Blackwellized particle filter, 0 for a single one with loop closure
+		rbpf_map_res_(0.05),						// cell size of the particles' lookup tables (meters)
+		rbpf_map_size_(100.0),						// side of the square particle grids, centered on the first keyframe (meters)
+		rbpf_resample_threshold_(0.5),				// fraction of particles the effective number falls below before resampling
 
 		/* Other private paramters */
+		start_pose_({{0, 0}, 0}),
+		odom_loc_(0, 0),
+		odom_angle_(0),
 		prev_odom_loc_(0, 0),
 		prev_odom_angle_(0),
 		odom_initialized_(false),
 		update_scan_(false),
-		// Grid starting at (-8, -8) in the base_link frame with width 16m and height 16m and 0.01m per cell
-		prob_grid_({-8,-8}, observation_likelihood_res_, 16, 16),
-		prob_grid_init_(false)
+		stop_backend_(false),
+		process_queued_(false),
+		pose_correction_(PoseCorrection({{{0, 0}, 0}, {0, 0}, 0})),
+		backend_initialized_(false),
+		MLE_pose_({{0, 0}, 0}),
+		MLE_odom_loc_(0, 0),
+		MLE_odom_angle_(0),
+		MLE_covariance_(Matrix3f::Zero()),
+		keyframe_descriptors_(descriptor_max_range_),
+		num_fixed_keyframes_(0),
+		last_loop_closure_attempt_(0),
+		loop_closure_submap_({{{0, 0}, 0}, CellGrid(), 0, 0}),
+		matching_submap_(0),
+		map_version_(0),
+		particle_rng_(1)
 {
-	map_scans_.reserve(1000000);
+	backend_ = std::thread(&SLAM::RunBackend, this);
+}
+
+SLAM::~SLAM() {
+	StopBackend(false);
+	StopRecording();
+}
+
+void SLAM::StopBackend(bool process_queued) {
+	if (not backend_.joinable()) return;
+	{
+		std::lock_guard<std::mutex> lock(keyframes_mutex_);
+		stop_backend_ = true;
+		process_queued_ = process_queued;
+	}
+	keyframes_cv_.notify_one();
+	backend_.join();
 }
 
 void SLAM::GetPose(Eigen::Vector2f* loc, float* angle) const {
-	// Return the latest pose estimate of the robot.
-	*loc = current_pose_.loc;
-	*angle = current_pose_.angle;
+	// Return the latest pose estimate of the robot: the pose the backend found
+	// for its last keyframe, moved by the odometry since then. This does not
+	// wait for keyframes in flight.
+	const PoseCorrection correction = pose_correction_.Load();
+	const Eigen::Rotation2Df R_odom2MLE(correction.pose.angle - correction.odom_angle);
+	const float angle_diff = AngleDiff(odom_angle_, correction.odom_angle);
+	*loc = correction.pose.loc + R_odom2MLE * (odom_loc_ - correction.odom_loc);
+	*angle = fmod(correction.pose.angle + angle_diff + M_PI, 2*M_PI) - M_PI;
 }
 
 // Done by Alex
@@ -124,66 +218,487 @@ vector<Vector2f>* SLAM::Scan2BaseLinkCloud(const LaserScan &s) const{
 }
 
 // Done by Alex
-// Populates the grid with probabilities due to a laser scan
-void SLAM::applyScan(LaserScan scan){
-	const vector<Vector2f>* points = Scan2BaseLinkCloud(scan);
-	prob_grid_.clear();
+// Populates the active submaps with probabilities due to a laser scan.
+// Submaps overlap: a new one is started whenever the newest has half a window
+// of keyframes, so that when the matching submap is frozen, the next one
+// already holds the last half window.
+void SLAM::applyScan(LaserScan scan, int keyframe){
+	// Freeze the matching submap once it is full or the robot has left it
+	if (not submaps_.empty()){
+		Submap &matching = submaps_[matching_submap_];
+		if (matching.num_keyframes >= submap_keyframes_ or (MLE_pose_.loc - matching.pose.loc).norm() > submap_range_){
+			// Keep the grid for the next submap, clearing it only costs what was written
+			std::swap(spare_grid_, matching.grid);
+			matching.grid = CellGrid();
+			matching_submap_++;
+		}
+	}
+	if (matching_submap_ == submaps_.size() or
+	    (submaps_.size() - matching_submap_ < 2 and 2*submaps_.back().num_keyframes >= submap_keyframes_)){
+		submaps_.push_back({MLE_pose_, CellGrid(), 0, keyframe});
+		std::swap(submaps_.back().grid, spare_grid_);
+		ClearSubmapGrid(&submaps_.back().grid);
+	}
+
+	for (size_t k = matching_submap_; k < submaps_.size(); k++){
+		InsertScan(&submaps_[k], scan, MLE_pose_);
+	}
+
+	// Max-pooled copies of the grid for branch and bound scan matching
+	if (branch_and_bound_CSM_){
+		prob_grid_pyramid_.resize(CSM_pyramid_levels_);
+		for (int level = 0; level < CSM_pyramid_levels_; level++){
+			const CellGrid &finer = (level == 0) ? MatchingSubmap().grid : prob_grid_pyramid_[level - 1];
+			prob_grid_pyramid_[level].maxPoolFrom(finer);
+		}
+	}
+}
+
+// Empty a submap grid, allocating it the first time
+void SLAM::ClearSubmapGrid(CellGrid* grid) const {
+	if (grid->getXCellCount() > 0){
+		// Clearing only costs what was written
+		grid->clear();
+	} else {
+		const float half_size = submap_size_ / 2;
+		*grid = CellGrid({-half_size, -half_size}, observation_likelihood_res_, submap_size_, submap_size_);
+	}
+}
+
+// Add a scan taken at a pose to the grid of a submap
+void SLAM::InsertScan(Submap* submap, const LaserScan &scan, const Pose &pose) const {
+	InsertScan(submap, *Scan2BaseLinkCloud(scan), pose);
+}
+
+// Takes the scan as base link points, so that it can be called from several
+// threads, as Scan2BaseLinkCloud can not
+void SLAM::InsertScan(Submap* submap, const vector<Vector2f> &base_link_points, const Pose &pose) const {
+	vector<Vector2f> points;
+	SubmapPoints(*submap, base_link_points, pose, &points);
+	InsertSubmapPoints(submap, points);
+}
 
-	for (const Vector2f &p : *points){
-		prob_grid_.applyLaserPoint(p, observation_likelihood_std_dev_);
+void SLAM::SubmapPoints(const Submap &submap, const vector<Vector2f> &base_link_points,
+                        const Pose &pose, vector<Vector2f>* points) const {
+	points->resize(base_link_points.size());
+	for (size_t i = 0; i < points->size(); i++){
+		(*points)[i] = TransformNewScanToPrevPose(base_link_points[i], pose, submap.pose);
 	}
-	prob_grid_init_ = true;
+}
+
+void SLAM::InsertSubmapPoints(Submap* submap, const vector<Vector2f> &points) const {
+	if (distance_transform_table_){
+		submap->grid.applyLaserPoints(points, observation_likelihood_std_dev_);
+	} else {
+		for (const Vector2f &p : points){
+			submap->grid.applyLaserPoint(p, observation_likelihood_std_dev_);
+		}
+	}
+	submap->num_keyframes++;
 }
 
 // Done by Alex
-Pose SLAM::ApplyCSM(LaserScan scan) {
+Pose SLAM::ApplyCSM(LaserScan scan, Matrix3f* covariance) {
+	vector<Vector2f>* base_link_scan = Scan2BaseLinkCloud(scan);
+	trimScan(base_link_scan, CSM_scan_offset_);
+
+	vector<float> pose_costs;
+	float laser_scan_cost = 0.0;
+	const int best_index = MatchScan(*base_link_scan, MatchingSubmap(), possible_poses_, CSM_num_threads_,
+	                                 &pose_costs, &laser_scan_cost);
+	if (best_index < 0) return Pose({{0, 0}, 0});
+	const float CSM_cost = laser_scan_weight_*laser_scan_cost;
+	const float MM_cost = motion_model_weight_*possible_poses_[best_index].log_likelihood;
+	cout << "New pose selected!" << "\t CSM_cost: " << CSM_cost << "\tMM_cost: " << MM_cost << endl;
+
+	if (covariance != NULL) *covariance = CSMCovariance(possible_poses_, pose_costs, best_index);
+	return possible_poses_[best_index].pose;
+}
+
+// Candidates are scored one angle at a time: the scan is rotated and converted
+// to cells of the lookup table once per angle, and each candidate's
+// translation is rounded to a whole number of cells, so that scoring it is
+// only integer offsets and table lookups.
+int SLAM::MatchScan(const vector<Vector2f> &base_link_scan, const Submap &submap,
+                    const vector<PoseWithLikelihood> &candidates, int num_threads,
+                    vector<float>* pose_costs, float* best_laser_scan_cost) const {
 	float max_cost = -std::numeric_limits<float>::infinity();
-	Pose best_pose = {{0,0},0};
+	int best_index = -1;
+	const int scan_size = base_link_scan.size();
+	pose_costs->assign(candidates.size(), -std::numeric_limits<float>::infinity());
+
+	// Group the candidates by angle, keeping their order within each group
+	vector<Vector2i> offsets;
+	CSMTranslationOffsets(submap, candidates, &offsets);
+	vector<int> order(candidates.size());
+	for (size_t j = 0; j < order.size(); j++) order[j] = j;
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b){
+		return candidates[a].pose.angle < candidates[b].pose.angle;
+	});
+
+	vector<size_t> group_start;
+	for (size_t k = 0; k < order.size(); k++){
+		if (k == 0 or candidates[order[k]].pose.angle != candidates[order[k - 1]].pose.angle){
+			group_start.push_back(k);
+		}
+	}
+	group_start.push_back(order.size());
+	const int num_groups = group_start.size() - 1;
+
+	// Each worker scores a contiguous range of angles and keeps its own best
+	// candidate. The grid and candidates are only read.
+	struct Candidate{
+		int index;
+		float pose_cost;
+		float laser_scan_cost;
+	};
+	const int num_workers = std::max(1, std::min(num_threads, num_groups));
+	const Candidate no_candidate = {-1, -std::numeric_limits<float>::infinity(), 0};
+	vector<Candidate> worker_best(num_workers, no_candidate);
+#ifdef _OPENMP
+	#pragma omp parallel for num_threads(num_workers) schedule(static, 1)
+#endif
+	for (int w = 0; w < num_workers; w++){
+		Candidate &best = worker_best[w];
+		vector<Vector2i> scan_cells;
+		const int groups_end = num_groups * (w + 1) / num_workers;
+		for (int g = num_groups * w / num_workers; g < groups_end; g++){
+			RotatedScanCells(submap, base_link_scan, candidates[order[group_start[g]]].pose.angle, &scan_cells);
+			for (size_t k = group_start[g]; k < group_start[g + 1]; k++){
+				const int j = order[k];
+				// Add up the log likelihoods, points outside of the grid add nothing
+				float laser_scan_cost = CSMLaserScanCost(submap.grid, scan_cells, offsets[j]);
+
+				// Factor in weighted motion model likelihood
+				float pose_cost = CSMPoseCost(laser_scan_cost, candidates[j].log_likelihood, scan_size);
+				(*pose_costs)[j] = pose_cost;
+
+				// Ties go to the first candidate, as if they were scored in order
+				if (pose_cost > best.pose_cost or (pose_cost == best.pose_cost and j < best.index)){
+					best.index = j;
+					best.pose_cost = pose_cost;
+					best.laser_scan_cost = laser_scan_cost;
+				}
+			}
+		}
+	}
+
+	// Reduce with the same tie breaking, so the result does not depend on the
+	// number of workers
+	for (const Candidate &best : worker_best){
+		if (best.index < 0) continue;
+		if (best.pose_cost > max_cost or (best.pose_cost == max_cost and best.index < best_index)){
+			best_index = best.index;
+			max_cost = best.pose_cost;
+			*best_laser_scan_cost = best.laser_scan_cost;
+		}
+	}
+	return best_index;
+}
+
+// Covariance of a match from the costs of the candidates, taking exp(pose
+// cost) as their relative probabilities (Olson, "Real-Time Correlative Scan
+// Matching", 2009). Candidates that were not scored have a cost of -infinity
+// and are left out. The floor keeps the pose graph from trusting a match
+// beyond the resolution of the lookup table.
+Matrix3f SLAM::CSMCovariance(const vector<PoseWithLikelihood> &candidates,
+                             const vector<float> &pose_costs, int best) const {
+	Matrix3f covariance = Matrix3f::Zero();
+	if (best >= 0){
+		const Pose &best_pose = candidates[best].pose;
+		double total = 0;
+		Eigen::Vector3d mean = Eigen::Vector3d::Zero();
+		Eigen::Matrix3d second_moment = Eigen::Matrix3d::Zero();
+		for (size_t j = 0; j < candidates.size(); j++){
+			if (not std::isfinite(pose_costs[j])) continue;
+			const double weight = exp(pose_costs[j] - pose_costs[best]);
+			const Eigen::Vector3d q(candidates[j].pose.loc.x() - best_pose.loc.x(),
+			                        candidates[j].pose.loc.y() - best_pose.loc.y(),
+			                        AngleDiff(candidates[j].pose.angle, best_pose.angle));
+			total += weight;
+			mean += weight*q;
+			second_moment += weight*q*q.transpose();
+		}
+		mean /= total;
+		covariance = (second_moment/total - mean*mean.transpose()).cast<float>();
+	}
+	covariance.diagonal() += Vector3f(Sq(CSM_min_translation_std_dev_), Sq(CSM_min_translation_std_dev_),
+	                                  Sq(CSM_min_angle_std_dev_));
+	return covariance;
+}
+
+// Translation of every candidate pose relative to a submap, in its frame,
+// rounded to whole cells of the lookup table
+void SLAM::CSMTranslationOffsets(const Submap &submap, const vector<PoseWithLikelihood> &candidates,
+                                 vector<Vector2i>* offsets) const {
+	const Pose &submap_pose = submap.pose;
+	const Eigen::Rotation2Df R_map2submap(-submap_pose.angle);
+	const float cells_per_meter = 1.0 / submap.grid.getResolution();
+	offsets->resize(candidates.size());
+	for (size_t j = 0; j < candidates.size(); j++){
+		const Vector2f translation = R_map2submap * (candidates[j].pose.loc - submap_pose.loc);
+		(*offsets)[j] = Vector2i(static_cast<int>(floor(translation.x() * cells_per_meter + 0.5)),
+		                         static_cast<int>(floor(translation.y() * cells_per_meter + 0.5)));
+	}
+}
+
+// Cells of the lookup table that the scan points fall in when the scan is
+// rotated to a candidate angle, before translation
+void SLAM::RotatedScanCells(const Submap &submap, const vector<Vector2f> &base_link_scan, float angle,
+                            vector<Vector2i>* cells) const {
+	const CellGrid &grid = submap.grid;
+	const Eigen::Rotation2Df R_newBaseLink2submap(AngleDiff(angle, submap.pose.angle));
+	cells->resize(base_link_scan.size());
+	for (size_t i = 0; i < base_link_scan.size(); i++){
+		(*cells)[i] = grid.floorIndex(R_newBaseLink2submap * base_link_scan[i]);
+	}
+}
+
+// Summed log likelihood of a rotated scan translated by a whole number of cells
+float SLAM::CSMLaserScanCost(const CellGrid &grid, const vector<Vector2i> &scan_cells, const Vector2i &offset) const {
+	float laser_scan_cost = 0.0;
+	for (const Vector2i &cell : scan_cells){
+		laser_scan_cost += grid.atOr(cell.x() + offset.x(), cell.y() + offset.y(), 0.0);
+	}
+	return laser_scan_cost;
+}
+
+// Combined cost of a candidate pose. Increasing in both the laser scan cost
+// and the motion model likelihood, which branch and bound relies on.
+float SLAM::CSMPoseCost(float laser_scan_cost, float log_likelihood, int scan_size) const {
+	float normalized_laser_cost  = laser_scan_cost/scan_size;
+	float normalized_motion_cost = log_likelihood/3.0; 
+	return laser_scan_weight_*normalized_laser_cost + motion_model_weight_*normalized_motion_cost;
+}
+
+// Correlative scan matching by branch and bound (Olson, "Real-Time
+// Correlative Scan Matching", 2009), returning the same pose as ApplyCSM.
+//
+// The candidates of one angle share the rotated scan and differ only in their
+// cell offsets, over an x-y lattice. A block of the lattice is bounded by
+// looking up, for every scan point, the finest max-pooled pyramid level where
+// all of the cells the point can land in fall in a 2x2 block of cells.
+// Out-of-grid cells score 0, and all cells of the grid score at most 0, so
+// points that can leave the grid are bounded by 0. Float summation is
+// monotone, so the bounds are never below the exact cost, and blocks are only
+// pruned when they cannot beat the best pose so far, with ties going to the
+// lowest candidate index as in ApplyCSM. The covariance is taken from the
+// candidates that were evaluated, the most likely ones.
+Pose SLAM::ApplyBranchAndBoundCSM(LaserScan scan, Matrix3f* covariance) {
+	const int nx = x_res_;
+	const int ny = y_res_;
+	const int nt = t_res_;
+	if (possible_poses_.empty() or possible_poses_.size() != size_t(nx*ny*nt) or prob_grid_pyramid_.empty()){
+		return ApplyCSM(scan, covariance);
+	}
 
 	vector<Vector2f>* base_link_scan = Scan2BaseLinkCloud(scan);
 	trimScan(base_link_scan, CSM_scan_offset_);
-	int scan_size = base_link_scan->size();
+	const int scan_size = base_link_scan->size();
+
+	const Submap &matching = MatchingSubmap();
+	vector<Vector2i> offsets;
+	CSMTranslationOffsets(matching, possible_poses_, &offsets);
+	vector<float> pose_costs(possible_poses_.size(), -std::numeric_limits<float>::infinity());
+	auto candidate = [&](int x_i, int y_i, int t_i){ return (x_i*ny + y_i)*nt + t_i; };
+
+	struct Block{
+		int x0, x1, y0, y1;   // Lattice indices [x0, x1) x [y0, y1)
+		float bound;
+	};
+	vector<Vector2i> scan_cells;
 
+	// Upper bound on the cost of every candidate in a block of one angle
+	const CellGrid &matching_grid = matching.grid;
+	const int grid_width = matching_grid.getXCellCount();
+	const int grid_height = matching_grid.getYCellCount();
+	auto bound = [&](Block* b, int t_i){
+		Vector2i offset_min = offsets[candidate(b->x0, b->y0, t_i)];
+		Vector2i offset_max = offset_min;
+		float max_log_likelihood = -std::numeric_limits<float>::infinity();
+		for (int x_i = b->x0; x_i < b->x1; x_i++){
+			for (int y_i = b->y0; y_i < b->y1; y_i++){
+				const int j = candidate(x_i, y_i, t_i);
+				offset_min = offset_min.cwiseMin(offsets[j]);
+				offset_max = offset_max.cwiseMax(offsets[j]);
+				max_log_likelihood = std::max(max_log_likelihood, possible_poses_[j].log_likelihood);
+			}
+		}
+		float laser_scan_bound = 0.0;
+		for (const Vector2i &cell : scan_cells){
+			const Vector2i lo = cell + offset_min;
+			const Vector2i hi = cell + offset_max;
+			if (lo.x() < 0 or lo.y() < 0 or hi.x() >= grid_width or hi.y() >= grid_height) continue;
+			// Finest level where the cells the point can land in span at most 2x2 cells
+			size_t level = 0;
+			while (level <= prob_grid_pyramid_.size() and
+			       ((hi.x() >> level) - (lo.x() >> level) > 1 or (hi.y() >> level) - (lo.y() >> level) > 1)) level++;
+			if (level > prob_grid_pyramid_.size()) continue;
+			const CellGrid &grid = (level == 0) ? matching_grid : prob_grid_pyramid_[level - 1];
+			const int x0 = lo.x() >> level;
+			const int y0 = lo.y() >> level;
+			const int x1 = hi.x() >> level;
+			const int y1 = hi.y() >> level;
+			laser_scan_bound += std::max(std::max(grid.at(x0, y0), grid.at(x1, y0)),
+			                             std::max(grid.at(x0, y1), grid.at(x1, y1)));
+		}
+		b->bound = CSMPoseCost(laser_scan_bound, max_log_likelihood, scan_size);
+	};
+
+	// Search the angles with the most promising bounds first
+	vector<std::pair<float, int> > angle_order(nt);
+	for (int t_i = 0; t_i < nt; t_i++){
+		RotatedScanCells(matching, *base_link_scan, possible_poses_[candidate(0, 0, t_i)].pose.angle, &scan_cells);
+		Block root = {0, nx, 0, ny, 0};
+		bound(&root, t_i);
+		angle_order[t_i] = std::make_pair(-root.bound, t_i);
+	}
+	std::sort(angle_order.begin(), angle_order.end());
+
+	float max_cost = -std::numeric_limits<float>::infinity();
+	int best_index = -1;
 	float CSM_cost = 0.0;
 	float MM_cost = 0.0;
-	for (const auto &pose : possible_poses_){
-		float laser_scan_cost = 0.0;
-		
-		// Loop through laser points in this scan and add up the log likelihoods
-		for (const Vector2f &loc : *base_link_scan){
-
-			try{
-				// Transform laser scan to last pose's base_link frame
-				Vector2f mapped_loc = TransformNewScanToPrevPose(loc, pose.pose);
-				laser_scan_cost += prob_grid_.atLoc(mapped_loc);
-
-			}catch(std::out_of_range &e){
+	int num_evaluated = 0;
+	vector<Block> stack;
+	for (const auto &angle : angle_order){
+		const int t_i = angle.second;
+		if (-angle.first < max_cost) break;
+		RotatedScanCells(matching, *base_link_scan, possible_poses_[candidate(0, 0, t_i)].pose.angle, &scan_cells);
+
+		stack.clear();
+		Block root = {0, nx, 0, ny, -angle.first};
+		stack.push_back(root);
+		while (not stack.empty()){
+			const Block b = stack.back();
+			stack.pop_back();
+			// The first candidate of a block has the lowest index
+			const int first = candidate(b.x0, b.y0, t_i);
+			if (b.bound < max_cost or (b.bound == max_cost and first > best_index)) continue;
+
+			if (b.x1 - b.x0 == 1 and b.y1 - b.y0 == 1){
+				const float laser_scan_cost = CSMLaserScanCost(matching_grid, scan_cells, offsets[first]);
+				const float pose_cost = CSMPoseCost(laser_scan_cost, possible_poses_[first].log_likelihood, scan_size);
+				pose_costs[first] = pose_cost;
+				num_evaluated++;
+				if (pose_cost > max_cost or (pose_cost == max_cost and first < best_index)){
+					best_index = first;
+					max_cost = pose_cost;
+					CSM_cost = laser_scan_weight_*laser_scan_cost;
+					MM_cost = motion_model_weight_*possible_poses_[first].log_likelihood;
+				}
 				continue;
 			}
+
+			// Split the longer side, and search the child with the higher bound first
+			Block low = b;
+			Block high = b;
+			if (b.x1 - b.x0 >= b.y1 - b.y0){
+				low.x1 = high.x0 = (b.x0 + b.x1) / 2;
+			} else {
+				low.y1 = high.y0 = (b.y0 + b.y1) / 2;
+			}
+			bound(&low, t_i);
+			bound(&high, t_i);
+			if (low.bound > high.bound){
+				stack.push_back(high);
+				stack.push_back(low);
+			} else {
+				stack.push_back(low);
+				stack.push_back(high);
+			}
 		}
+	}
+	if (kDebug) {
+		cout << "New pose selected!" << "\t CSM_cost: " << CSM_cost << "\tMM_cost: " << MM_cost
+		     << "\tevaluated: " << num_evaluated << "/" << possible_poses_.size() << endl;
+	}
+
+	if (best_index < 0) return ApplyCSM(scan, covariance);
+	if (covariance != NULL) *covariance = CSMCovariance(possible_poses_, pose_costs, best_index);
+	return possible_poses_[best_index].pose;
+}
 
-		// Factor in weighted motion model likelihood
-		float normalized_laser_cost  = laser_scan_cost/scan_size;
-		float normalized_motion_cost = pose.log_likelihood/3.0; 
-		float pose_cost = laser_scan_weight_*normalized_laser_cost + motion_model_weight_*normalized_motion_cost;
+// Levenberg-Marquardt refinement of a pose against a bicubic interpolation of
+// a submap, in the submap's frame. The lookup table holds
+// -d^2/std_dev^2 at distance d from the nearest mapped point, so each scan
+// point's residual is its distance in standard deviations, sqrt(-value).
+// Residuals are under a Cauchy loss so that points far from anything mapped
+// do not pull the pose, and steps are only taken if they lower the cost, so
+// the result never scores worse than the CSM pose.
+Pose SLAM::RefineCSMPose(LaserScan scan, const Submap &submap, Pose pose) {
+	vector<Vector2f> points = *Scan2BaseLinkCloud(scan);
+	trimScan(&points, refine_scan_offset_);
+	return RefineMatch(points, submap, pose);
+}
+
+Pose SLAM::RefineMatch(const vector<Vector2f> &points, const Submap &submap, Pose pose) const {
+	const float loss_scale_squared = refine_loss_scale_*refine_loss_scale_;
+
+	// Robust cost of the scan at a pose (x, y, theta) in the submap frame, and
+	// the Gauss-Newton approximation of its Hessian and its gradient
+	auto cost = [&](const Vector3f &q, Matrix3f* H, Vector3f* g){
+		const Eigen::Rotation2Df R(q.z());
+		H->setZero();
+		g->setZero();
+		float total = 0;
+		for (const Vector2f &p : points){
+			const Vector2f rotated = R * p;
+			Vector2f gradient;
+			const float value = submap.grid.interpolate(q.head<2>() + rotated, &gradient);
+			const float squared_residual = std::max(0.0f, -value);
+			total += 0.5f*loss_scale_squared*log1p(squared_residual/loss_scale_squared);
+			if (squared_residual < 1e-6) continue;
+			// Derivative of the residual, from d(-value)/dq = 2 r dr/dq
+			const Vector3f dvalue_dq(gradient.x(), gradient.y(),
+			                         gradient.x()*-rotated.y() + gradient.y()*rotated.x());
+			const float residual = sqrt(squared_residual);
+			const Vector3f J = -dvalue_dq / (2*residual);
+			const float weight = 1.0f / (1.0f + squared_residual/loss_scale_squared);
+			*H += weight * J * J.transpose();
+			*g += weight * residual * J;
+		}
+		return total;
+	};
 
-		if (pose_cost > max_cost){
-			best_pose = pose.pose;
-			max_cost = pose_cost;
-			CSM_cost = laser_scan_weight_*laser_scan_cost;
-			MM_cost = motion_model_weight_*pose.log_likelihood;
+	const Eigen::Rotation2Df R_map2submap(-submap.pose.angle);
+	const Vector2f start_loc = R_map2submap * (pose.loc - submap.pose.loc);
+	Vector3f q(start_loc.x(), start_loc.y(), AngleDiff(pose.angle, submap.pose.angle));
+	Matrix3f H, H_next;
+	Vector3f g, g_next;
+	const float start_cost = cost(q, &H, &g);
+	float current_cost = start_cost;
+	float lambda = 1e-3;
+	for (int i = 0; i < refine_iterations_; i++){
+		Matrix3f A = H;
+		A.diagonal() *= 1 + lambda;
+		A.diagonal().array() += 1e-6;
+		const Vector3f step = -A.ldlt().solve(g);
+		const float next_cost = cost(q + step, &H_next, &g_next);
+		if (next_cost < current_cost){
+			q += step;
+			current_cost = next_cost;
+			H = H_next;
+			g = g_next;
+			lambda *= 0.1;
+			if (step.head<2>().norm() < 1e-4 and fabs(step.z()) < 1e-4) break;
+		} else {
+			lambda *= 10;
 		}
 	}
-	cout << "New pose selected!" << "\t CSM_cost: " << CSM_cost << "\tMM_cost: " << MM_cost << endl;
+	if (not (current_cost < start_cost)) return pose;
 
-	return best_pose;
+	const Eigen::Rotation2Df R_submap2map(submap.pose.angle);
+	const Pose refined = {submap.pose.loc + R_submap2map * q.head<2>(),
+	                      static_cast<float>(AngleMod(submap.pose.angle + q.z()))};
+	return refined;
 }
 
 // Done by Connor
-Eigen::Vector2f SLAM::TransformNewScanToPrevPose(const Eigen::Vector2f scan_loc, Pose pose_cur){
-    Vector2f odom_trans_diff = pose_cur.loc - MLE_pose_.loc;			 // In the map frame
-    float odom_angle_diff = AngleDiff(pose_cur.angle, MLE_pose_.angle);	 // Frame independent
-    Eigen::Rotation2Df R_map2oldBaseLink(-MLE_pose_.angle);
+Eigen::Vector2f SLAM::TransformNewScanToPrevPose(const Eigen::Vector2f scan_loc, Pose pose_cur, Pose ref_pose) const{
+    Vector2f odom_trans_diff = pose_cur.loc - ref_pose.loc;			 // In the map frame
+    float odom_angle_diff = AngleDiff(pose_cur.angle, ref_pose.angle);	 // Frame independent
+    Eigen::Rotation2Df R_map2oldBaseLink(-ref_pose.angle);
     Eigen::Rotation2Df R_newBaseLink2oldBaseLink(odom_angle_diff);
     Vector2f mapped_scan = R_map2oldBaseLink * odom_trans_diff + R_newBaseLink2oldBaseLink * scan_loc;
     return mapped_scan;
@@ -197,49 +712,454 @@ void SLAM::ObserveLaser(const vector<float>& ranges,
                                      float angle_max,
                                      amrl_msgs::VisualizationMsg &viz) {
 	// Test whether we need to update the map with the current laser scan
-	bool apply_scan_flag = update_scan_ or (odom_initialized_ and not prob_grid_init_);
+	if (not odom_initialized_ or not update_scan_) return;
+
+	Keyframe keyframe = {LaserScan({ranges, range_min, range_max, angle_min, angle_max}), prev_odom_loc_, prev_odom_angle_};
+	{
+		std::lock_guard<std::mutex> lock(keyframes_mutex_);
+		// The backend matches each keyframe against the last one it processed,
+		// so when it falls behind, skipping a keyframe only widens that step
+		if (keyframes_.size() >= max_queued_keyframes_) keyframes_.pop_front();
+		keyframes_.push_back(std::move(keyframe));
+	}
+	keyframes_cv_.notify_one();
+	update_scan_ = false;
+}
+
+// Process keyframes until the SLAM object is destroyed
+void SLAM::RunBackend() {
+	std::unique_lock<std::mutex> lock(keyframes_mutex_);
+	while (true){
+		keyframes_cv_.wait(lock, [this]{ return stop_backend_ or not keyframes_.empty(); });
+		if (stop_backend_ and (keyframes_.empty() or not process_queued_)) return;
+		const Keyframe keyframe = std::move(keyframes_.front());
+		keyframes_.pop_front();
+		lock.unlock();
+		ProcessKeyframe(keyframe);
+		lock.lock();
+	}
+}
+
+// Match a keyframe against the matching submap, then add it to the pose
+// graph, the map and the active submaps, and try to close a loop with it
+void SLAM::ProcessKeyframe(const Keyframe &keyframe) {
+	current_scan_ = keyframe.scan;
+
+	if (backend_initialized_ and rbpf_particles_ > 0){
+		MLE_pose_ = UpdateParticles(keyframe, &MLE_covariance_);
+	} else if (backend_initialized_){
+		// Predict the pose from the odometry since the last keyframe
+		const Vector2f odom_diff = keyframe.odom_loc - MLE_odom_loc_;
+		const float angle_diff = AngleDiff(keyframe.odom_angle, MLE_odom_angle_);
+		const Eigen::Rotation2Df R_odom2MLE(MLE_pose_.angle - MLE_odom_angle_);
+		const Vector2f predicted_loc = MLE_pose_.loc + R_odom2MLE * odom_diff;
+		const float predicted_angle = fmod(MLE_pose_.angle + angle_diff + M_PI, 2*M_PI) - M_PI;
+		// updates possible_poses_
+		ApplyMotionModel(predicted_loc, predicted_angle, odom_diff.norm(), angle_diff);
 
-	if (apply_scan_flag){
-		current_scan_ = LaserScan({ranges, range_min, range_max, angle_min, angle_max});
-		
 		// Transform the current scan centered around possible poses from
 		// motion model to find best fit with lookup table from previous scan
-		MLE_pose_ = ApplyCSM(current_scan_);
-		updateMap(MLE_pose_);
-		R_odom2MLE_ = Eigen::Rotation2Df(MLE_pose_.angle - prev_odom_angle_);
-		
-		// Get lookup table, preparing for next scan
-		applyScan(current_scan_);
-		update_scan_ = false;
+		MLE_pose_ = branch_and_bound_CSM_ ? ApplyBranchAndBoundCSM(current_scan_, &MLE_covariance_)
+		                                  : ApplyCSM(current_scan_, &MLE_covariance_);
+		if (refine_CSM_) MLE_pose_ = RefineCSMPose(current_scan_, MatchingSubmap(), MLE_pose_);
+	} else {
+		// This is the first keyframe, at the start pose: the origin, or the last
+		// keyframe of a loaded map
+		MLE_covariance_ = CSMCovariance(possible_poses_, vector<float>(), -1);
+		if (rbpf_particles_ > 0) InitializeParticles();
+	}
+	backend_initialized_ = true;
+
+	// Chain the keyframe to the previous one
+	const int keyframe_index = pose_graph_.AddNode(PoseVector(MLE_pose_));
+	keyframe_scans_.push_back(current_scan_);
+	keyframe_descriptors_.Add(current_scan_.ranges, current_scan_.range_min, current_scan_.range_max);
+	IndexKeyframe(keyframe_index, MLE_pose_.loc, true);
+	if (keyframe_index > 0) AddPoseGraphEdge(keyframe_index - 1, keyframe_index, MLE_pose_, MLE_covariance_);
+
+	MLE_odom_loc_ = keyframe.odom_loc;
+	MLE_odom_angle_ = keyframe.odom_angle;
+	pose_correction_.Store({MLE_pose_, MLE_odom_loc_, MLE_odom_angle_});
+	updateMap(MLE_pose_);
+
+	// Particles keep their own maps, and close loops by resampling
+	if (rbpf_particles_ > 0) return;
+
+	// Get lookup table, preparing for next scan
+	applyScan(current_scan_, keyframe_index);
+
+	// A loop closure moves the recent keyframes, this one included
+	if (loop_closure_ and CloseLoop()) pose_correction_.Store({MLE_pose_, MLE_odom_loc_, MLE_odom_angle_});
+}
+
+Pose SLAM::KeyframePose(int i) const {
+	const Vector3f &pose = pose_graph_.GetNode(i);
+	return Pose({{pose.x(), pose.y()}, pose.z()});
+}
+
+// Constrain a keyframe to a pose relative to another keyframe. The covariance
+// of the pose is in the map frame, and is rotated into the other keyframe's.
+void SLAM::AddPoseGraphEdge(int from, int to, Pose to_pose, const Matrix3f &covariance) {
+	const Vector3f &from_pose = pose_graph_.GetNode(from);
+	Matrix3f R_map2from = Matrix3f::Identity();
+	R_map2from.topLeftCorner<2, 2>() = Eigen::Rotation2Df(-from_pose.z()).toRotationMatrix();
+	const Matrix3f relative_covariance = R_map2from * covariance * R_map2from.transpose();
+	pose_graph_.AddEdge(from, to, PoseGraph::RelativePose(from_pose, PoseVector(to_pose)),
+	                    relative_covariance.inverse());
+}
+
+// Add a keyframe to, or remove it from, the cell of its location
+void SLAM::IndexKeyframe(int i, const Vector2f &loc, bool add) {
+	vector<int> &cell = keyframe_cells_[CellKey(loc, loop_closure_radius_)];
+	if (add){
+		cell.push_back(i);
+	} else {
+		cell.erase(std::remove(cell.begin(), cell.end(), i), cell.end());
+	}
+}
+
+// Candidates for closing a loop with the current keyframe are keyframes at
+// least loop_closure_min_separation_ keyframes older: the nearest one, and
+// the ones with the most similar scan descriptors, which are found even when
+// drift has moved them away. Candidates are matched in that order until one
+// closes the loop. Returns whether the poses changed.
+bool SLAM::CloseLoop() {
+	const int current = pose_graph_.NumNodes() - 1;
+	if (current - last_loop_closure_attempt_ < loop_closure_interval_) return false;
+	const int num_old = current - loop_closure_min_separation_ + 1;
+	if (num_old <= 0) return false;
+
+	// Keyframes within loop_closure_radius_ are in the 3x3 cells around this one
+	const Vector2f &loc = MLE_pose_.loc;
+	int nearest = -1;
+	float nearest_dist = loop_closure_radius_;
+	for (int dx = -1; dx <= 1; dx++){
+		for (int dy = -1; dy <= 1; dy++){
+			const auto cell = keyframe_cells_.find(CellKey(loc + loop_closure_radius_*Vector2f(dx, dy), loop_closure_radius_));
+			if (cell == keyframe_cells_.end()) continue;
+			for (const int i : cell->second){
+				if (i >= num_old) continue;
+				const float dist = (KeyframePose(i).loc - loc).norm();
+				if (dist < nearest_dist){
+					nearest_dist = dist;
+					nearest = i;
+				}
+			}
+		}
+	}
+	vector<int> candidates;
+	if (nearest >= 0) candidates.push_back(nearest);
+
+	vector<std::pair<int, int> > neighbors;
+	keyframe_descriptors_.Search(current, num_old, loop_closure_descriptor_candidates_, &neighbors);
+	for (const auto &neighbor : neighbors){
+		const int i = neighbor.second;
+		if (neighbor.first > loop_closure_max_descriptor_distance_ or i == nearest or
+		    (KeyframePose(i).loc - loc).norm() > loop_closure_max_distance_) continue;
+		candidates.push_back(i);
+	}
+	if (candidates.empty()) return false;
+	last_loop_closure_attempt_ = current;
+
+	for (const int candidate : candidates){
+		if (MatchLoopClosure(candidate)) return true;
+	}
+	return false;
+}
+
+// Match the current keyframe against a loop closure candidate, searching a
+// window much wider than the motion model's. The window is around the current
+// pose, or, for a candidate further than loop_closure_radius_ from it, around
+// the candidate's location. A match that most of the scan agrees with
+// constrains the two keyframes in the pose graph, which is then optimized
+// from the older one on.
+bool SLAM::MatchLoopClosure(int candidate) {
+	const int current = pose_graph_.NumNodes() - 1;
+
+	// Grid of the candidate and its neighbors, in the candidate's frame
+	Submap &loop = loop_closure_submap_;
+	loop.pose = KeyframePose(candidate);
+	loop.keyframe = candidate;
+	loop.num_keyframes = 0;
+	ClearSubmapGrid(&loop.grid);
+	const int last_neighbor = std::min(candidate + loop_closure_neighbors_, current - loop_closure_min_separation_);
+	for (int i = std::max(0, candidate - loop_closure_neighbors_); i <= last_neighbor; i++){
+		InsertScan(&loop, keyframe_scans_[i], KeyframePose(i));
 	}
-	// if (prob_grid_init_) prob_grid_.showGrid(viz);
+
+	const int nxy = 2*static_cast<int>(loop_closure_window_xy_/loop_closure_lattice_xy_ + 0.5) + 1;
+	const int nt = 2*static_cast<int>(loop_closure_window_angle_/loop_closure_lattice_angle_ + 0.5) + 1;
+	Pose center = MLE_pose_;
+	if ((loop.pose.loc - MLE_pose_.loc).norm() > loop_closure_radius_) center.loc = loop.pose.loc;
+	SearchLattice(center, loop_closure_window_xy_, loop_closure_window_xy_, loop_closure_window_angle_,
+	              nxy, nxy, nt, &loop_closure_poses_);
+	vector<Vector2f> scan = *Scan2BaseLinkCloud(current_scan_);
+	trimScan(&scan, CSM_scan_offset_);
+	vector<float> pose_costs;
+	float laser_scan_cost = 0.0;
+	const int best = MatchScan(scan, loop, loop_closure_poses_, CSM_num_threads_, &pose_costs, &laser_scan_cost);
+	if (best < 0) return false;
+	Pose matched = loop_closure_poses_[best].pose;
+	if (refine_CSM_) matched = RefineCSMPose(current_scan_, loop, matched);
+
+	int inliers = 0;
+	for (const Vector2f &p : scan){
+		float value;
+		if (loop.grid.tryAt(TransformNewScanToPrevPose(p, matched, loop.pose), &value) and
+		    value > loop_closure_inlier_cost_) inliers++;
+	}
+	if (inliers < loop_closure_min_inliers_*scan.size()) return false;
+
+	if (kDebug) {
+		cout << "Loop closed with keyframe " << candidate << "\tcorrection: "
+		     << (matched.loc - MLE_pose_.loc).norm() << " m" << endl;
+	}
+	AddPoseGraphEdge(candidate, current, matched, CSMCovariance(loop_closure_poses_, pose_costs, best));
+	OptimizePoseGraph(std::max(std::max(candidate, current - pose_graph_window_), num_fixed_keyframes_));
+	return true;
+}
+
+// Optimize the keyframes from first on and move them to their new poses
+void SLAM::OptimizePoseGraph(int first) {
+	const int num_keyframes = pose_graph_.NumNodes();
+	vector<Pose> old_poses;
+	for (int i = first; i < num_keyframes; i++) old_poses.push_back(KeyframePose(i));
+	if (not pose_graph_.Optimize(first, pose_graph_iterations_)) return;
+	MoveKeyframes(first, old_poses);
+}
+
+// Move the hits in the map of the keyframes from first on, and the submaps
+// that start at them, from their old poses to their poses in the pose graph.
+// Submap grids are kept as they are.
+void SLAM::MoveKeyframes(int first, const vector<Pose> &old_poses) {
+	const int num_keyframes = pose_graph_.NumNodes();
+	std::lock_guard<std::mutex> lock(map_mutex_);
+	map_version_++;
+	vector<KeyframePoseRecord> records;
+	for (int i = first; i < num_keyframes; i++){
+		const Pose &old_pose = old_poses[i - first];
+		const Pose new_pose = KeyframePose(i);
+		records.push_back({new_pose.loc.x(), new_pose.loc.y(), new_pose.angle});
+		if ((new_pose.loc - old_pose.loc).norm() < 1e-4 and fabs(AngleDiff(new_pose.angle, old_pose.angle)) < 1e-4) continue;
+		AddScanToMap(keyframe_scans_[i], old_pose, -1);
+		AddScanToMap(keyframe_scans_[i], new_pose, 1);
+		if (CellKey(old_pose.loc, loop_closure_radius_) != CellKey(new_pose.loc, loop_closure_radius_)){
+			IndexKeyframe(i, old_pose.loc, false);
+			IndexKeyframe(i, new_pose.loc, true);
+		}
+	}
+	CompactMapChanges();
+	if (map_writer_.IsOpen()){
+		const KeyframePosesRecord keyframe_poses = {static_cast<uint32_t>(first), static_cast<uint32_t>(records.size())};
+		map_writer_.WriteKeyframePoses(keyframe_poses, records.data());
+	}
+
+	for (Submap &submap : submaps_){
+		if (submap.keyframe >= first) submap.pose = KeyframePose(submap.keyframe);
+	}
+	MLE_pose_ = KeyframePose(num_keyframes - 1);
+}
+
+// All particles start at the pose of the first keyframe, with one map of its
+// scan and the keyframes of a loaded map, which they share until their scans
+// diverge
+void SLAM::InitializeParticles() {
+	const float half_size = rbpf_map_size_ / 2;
+	const CellGrid grid(MLE_pose_.loc - Vector2f(half_size, half_size), rbpf_map_res_, rbpf_map_size_, rbpf_map_size_);
+	const int keyframe = pose_graph_.NumNodes();
+	Particle particle = {MLE_pose_, 0, {{{0, 0}, 0}, grid, 0, keyframe}, nullptr};
+	for (int i = 0; i < keyframe; i++) InsertScan(&particle.map, keyframe_scans_[i], KeyframePose(i));
+	InsertScan(&particle.map, current_scan_, MLE_pose_);
+	particle.trajectory = std::make_shared<const TrajectoryNode>(TrajectoryNode({MLE_pose_, keyframe, nullptr}));
+	particles_.assign(rbpf_particles_, particle);
+}
+
+// Rao-Blackwellized particle filter step (Grisetti et al., "Improved
+// Techniques for Grid Mapping with Rao-Blackwellized Particle Filters",
+// 2007). Each particle matches the scan against its own map over a lattice
+// around its odometry prediction, draws its new pose from the lattice in
+// proportion to exp(pose cost), and is weighted by the sum of exp(pose cost),
+// the likelihood of the scan given its map. Particles are matched and their
+// maps updated in parallel, one particle per thread. Writing a map copies the
+// tiles it shares with other particles, which reads reference counts shared
+// between them, so the tiles each scan will write are copied beforehand, one
+// particle at a time. Returns the pose of the most likely particle.
+Pose SLAM::UpdateParticles(const Keyframe &keyframe, Matrix3f* covariance) {
+	const Vector2f odom_diff = keyframe.odom_loc - MLE_odom_loc_;
+	const float angle_diff = AngleDiff(keyframe.odom_angle, MLE_odom_angle_);
+	const vector<Vector2f> points = *Scan2BaseLinkCloud(current_scan_);
+	vector<Vector2f> CSM_points = points;
+	trimScan(&CSM_points, CSM_scan_offset_);
+	vector<Vector2f> refine_points = points;
+	trimScan(&refine_points, refine_scan_offset_);
+	const int keyframe_index = pose_graph_.NumNodes();
+	const int num_particles = particles_.size();
+
+	vector<vector<PoseWithLikelihood> > candidates(num_particles);
+	vector<vector<float> > pose_costs(num_particles);
+	vector<int> best(num_particles);
+#ifdef _OPENMP
+	#pragma omp parallel for num_threads(CSM_num_threads_) schedule(dynamic)
+#endif
+	for (int k = 0; k < num_particles; k++){
+		const Pose &pose = particles_[k].pose;
+		const Eigen::Rotation2Df R_odom2particle(pose.angle - MLE_odom_angle_);
+		const Pose predicted = {pose.loc + R_odom2particle * odom_diff, static_cast<float>(AngleMod(pose.angle + angle_diff))};
+		MotionModelLattice(predicted, odom_diff.norm(), angle_diff, &candidates[k]);
+		float laser_scan_cost = 0;
+		best[k] = MatchScan(CSM_points, particles_[k].map, candidates[k], 1, &pose_costs[k], &laser_scan_cost);
+	}
+
+	// Draw the poses in order, so that runs are repeatable
+	vector<Pose> drawn(num_particles);
+	for (int k = 0; k < num_particles; k++){
+		const vector<float> &costs = pose_costs[k];
+		const float max_cost = costs[best[k]];
+		double total = 0;
+		for (const float cost : costs) total += exp(cost - max_cost);
+		particles_[k].log_weight += max_cost + log(total);
+		double u = particle_rng_.UniformRandom(0, total);
+		size_t j = 0;
+		for (; j + 1 < costs.size(); j++){
+			u -= exp(costs[j] - max_cost);
+			if (u < 0) break;
+		}
+		drawn[k] = candidates[k][j].pose;
+	}
+
+	vector<vector<Vector2f> > map_points(num_particles);
+#ifdef _OPENMP
+	#pragma omp parallel for num_threads(CSM_num_threads_) schedule(dynamic)
+#endif
+	for (int k = 0; k < num_particles; k++){
+		Particle &particle = particles_[k];
+		particle.pose = refine_CSM_ ? RefineMatch(refine_points, particle.map, drawn[k]) : drawn[k];
+		SubmapPoints(particle.map, points, particle.pose, &map_points[k]);
+	}
+	for (int k = 0; k < num_particles; k++){
+		particles_[k].map.grid.makeWritable(map_points[k], observation_likelihood_std_dev_);
+	}
+#ifdef _OPENMP
+	#pragma omp parallel for num_threads(CSM_num_threads_) schedule(dynamic)
+#endif
+	for (int k = 0; k < num_particles; k++){
+		Particle &particle = particles_[k];
+		InsertSubmapPoints(&particle.map, map_points[k]);
+		particle.trajectory = std::make_shared<const TrajectoryNode>(TrajectoryNode({particle.pose, keyframe_index, particle.trajectory}));
+	}
+
+	int most_likely = 0;
+	for (int k = 1; k < num_particles; k++){
+		if (particles_[k].log_weight > particles_[most_likely].log_weight) most_likely = k;
+	}
+	const Particle &particle = particles_[most_likely];
+	if (covariance != NULL) *covariance = CSMCovariance(candidates[most_likely], pose_costs[most_likely], best[most_likely]);
+	FollowTrajectory(particle.trajectory->previous);
+	const Pose pose = particle.pose;
+	ResampleParticles();
+	return pose;
+}
+
+// Low-variance resampling (Thrun et al., "Probabilistic Robotics", 2005),
+// only once the effective number of particles drops below
+// rbpf_resample_threshold_ of them. Copies of a particle share its map tiles
+// and trajectory.
+void SLAM::ResampleParticles() {
+	const int num_particles = particles_.size();
+	double max_log_weight = -std::numeric_limits<double>::infinity();
+	for (const Particle &particle : particles_) max_log_weight = std::max(max_log_weight, particle.log_weight);
+	vector<double> weights(num_particles);
+	double total = 0;
+	for (int k = 0; k < num_particles; k++){
+		// Keep the log weights near 0 as they accumulate
+		particles_[k].log_weight -= max_log_weight;
+		weights[k] = exp(particles_[k].log_weight);
+		total += weights[k];
+	}
+	double sum_squares = 0;
+	for (double &weight : weights){
+		weight /= total;
+		sum_squares += weight*weight;
+	}
+	if (1.0/sum_squares >= rbpf_resample_threshold_*num_particles) return;
+
+	vector<Particle> resampled;
+	resampled.reserve(num_particles);
+	const double step = 1.0/num_particles;
+	double u = particle_rng_.UniformRandom(0, step);
+	double cumulative = weights[0];
+	int k = 0;
+	for (int m = 0; m < num_particles; m++, u += step){
+		while (u > cumulative and k + 1 < num_particles) cumulative += weights[++k];
+		resampled.push_back(particles_[k]);
+		resampled.back().log_weight = 0;
+	}
+	particles_.swap(resampled);
+}
+
+// Move the keyframes before the current one to the trajectory of the most
+// likely particle, back to the pose graph window. Only the keyframes whose
+// poses changed, which is none while the same particle stays the most
+// likely, have their hits moved.
+void SLAM::FollowTrajectory(std::shared_ptr<const TrajectoryNode> node) {
+	int first = pose_graph_.NumNodes();
+	vector<Pose> poses;
+	while (node and node->keyframe == first - 1 and first > num_fixed_keyframes_ and
+	       static_cast<int>(poses.size()) < pose_graph_window_){
+		poses.push_back(node->pose);
+		first--;
+		node = node->previous;
+	}
+	std::reverse(poses.begin(), poses.end());
+	vector<Pose> old_poses;
+	bool moved = false;
+	for (size_t i = 0; i < poses.size(); i++){
+		old_poses.push_back(KeyframePose(first + i));
+		const Vector3f pose = PoseVector(poses[i]);
+		moved = moved or pose != pose_graph_.GetNode(first + i);
+		pose_graph_.SetNode(first + i, pose);
+	}
+	if (moved) MoveKeyframes(first, old_poses);
 }
 
 // Done by Mark
 void SLAM::ApplyMotionModel(Eigen::Vector2f loc, float angle, float dist_traveled, float angle_diff) {
-	possible_poses_.clear();
+	MotionModelLattice({loc, angle}, dist_traveled, angle_diff, &possible_poses_);
+}
+
+void SLAM::MotionModelLattice(Pose predicted, float dist_traveled, float angle_diff,
+                              vector<PoseWithLikelihood>* candidates) const {
 	// Introduce noise based on motion model
 	const float abs_angle_diff = abs(angle_diff);
 	const float x_stddev = k1_*dist_traveled + k2_*abs_angle_diff;
 	const float y_stddev = k1_*dist_traveled + k2_*abs_angle_diff;
 	const float t_stddev = k3_*dist_traveled + k4_*abs_angle_diff;
+	SearchLattice(predicted, x_stddev, y_stddev, t_stddev, x_res_, y_res_, t_res_, candidates);
+}
+
+// Candidates span one standard deviation on each side of the center, along
+// the axes of its frame
+void SLAM::SearchLattice(Pose center, float x_stddev, float y_stddev, float t_stddev,
+                         int nx, int ny, int nt, vector<PoseWithLikelihood>* candidates) const {
+	candidates->clear();
+	const Vector2f &loc = center.loc;
+	const float angle = center.angle;
+	// Offset of lattice index i of n, from -1 to 1
+	auto lattice = [](int i, int n){ return (n > 1) ? 2*i/(n - 1.0f) - 1 : 0.0f; };
 	// Precalculate trig stuff for rotation
 	const float cos_ang = cos(angle);
 	const float sin_ang = sin(angle);
 
 	// 3 for loops for each dimension of voxel cube (x, y, theta)
-	for (int x_i=0; x_i<x_res_; x_i++)
+	for (int x_i=0; x_i<nx; x_i++)
 	{
-		float x_noise = x_stddev*(2*x_i/(x_res_-1)-1);
-		// float x_noise = 0; //odom only
-		for (int y_i=0; y_i<y_res_; y_i++)
+		float x_noise = x_stddev*lattice(x_i, nx);
+		for (int y_i=0; y_i<ny; y_i++)
 		{
-			float y_noise = y_stddev*(2*y_i/(y_res_-1)-1);
-			// float y_noise = 0; //odom only
-			for (int t_i=0; t_i<t_res_; t_i++)
+			float y_noise = y_stddev*lattice(y_i, ny);
+			for (int t_i=0; t_i<nt; t_i++)
 			{
-				float t_noise = t_stddev*(2*t_i/(t_res_-1)-1);
-				// float t_noise = 0; //odom only
+				float t_noise = t_stddev*lattice(t_i, nt);
 				float t_pose = angle + t_noise;
 				float x_pose = loc.x() + x_noise*cos_ang - y_noise*sin_ang;
 				float y_pose = loc.y() + x_noise*sin_ang + y_noise*cos_ang;
@@ -249,7 +1169,7 @@ void SLAM::ApplyMotionModel(Eigen::Vector2f loc, float angle, float dist_travele
 								   -(t_noise*t_noise)/(t_stddev*t_stddev);
 				
 				Pose this_pose = {{x_pose, y_pose}, t_pose};
-				possible_poses_.push_back({this_pose, log_likelihood});
+				candidates->push_back({this_pose, log_likelihood});
 			}
 		}
 	}
@@ -257,11 +1177,16 @@ void SLAM::ApplyMotionModel(Eigen::Vector2f loc, float angle, float dist_travele
 
 // Done by Mark
 void SLAM::ObserveOdometry(const Vector2f& odom_loc, const float odom_angle) {
+	odom_loc_ = odom_loc;
+	odom_angle_ = odom_angle;
 	if (!odom_initialized_) {
 		prev_odom_angle_ = odom_angle;
 		prev_odom_loc_ = odom_loc;
 		odom_initialized_ = true;
 		update_scan_ = true;
+		// Nothing has been queued yet, so the backend is not writing. The
+		// first keyframe will be at the start pose.
+		pose_correction_.Store({start_pose_, odom_loc, odom_angle});
 		return;
 	}
 
@@ -270,15 +1195,9 @@ void SLAM::ObserveOdometry(const Vector2f& odom_loc, const float odom_angle) {
 	float angle_diff = AngleDiff(odom_angle, prev_odom_angle_);
 	float dist_traveled = odom_diff.norm();
 
-	// Update current estimate of pose
-	current_pose_.loc = MLE_pose_.loc + R_odom2MLE_ * odom_diff;
-	current_pose_.angle = fmod(MLE_pose_.angle + angle_diff + M_PI, 2*M_PI) - M_PI;
-
 	if (dist_traveled > linear_diff_threshold_ or abs(angle_diff) > angular_diff_threshold_)
 	{
-		// updates possible_poses_
-		ApplyMotionModel(current_pose_.loc, current_pose_.angle, dist_traveled, angle_diff);
-		// Save the current laser scan
+		// Save the next laser scan as a keyframe
 		update_scan_ = true;
 		prev_odom_angle_ = odom_angle;
 		prev_odom_loc_ = odom_loc;
@@ -287,32 +1206,225 @@ void SLAM::ObserveOdometry(const Vector2f& odom_loc, const float odom_angle) {
 
 // Done by Mark
 void SLAM::updateMap(Pose CSM_pose) {
+	std::lock_guard<std::mutex> lock(map_mutex_);
+	map_version_++;
+	AddScanToMap(current_scan_, CSM_pose, 1);
+
+	// Recorded under the lock, so that map snapshots in the file include
+	// exactly the keyframes before them
+	RecordKeyframe(current_scan_, CSM_pose);
+	CompactMapChanges();
+}
+
+void SLAM::RecordKeyframe(const LaserScan &scan, const Pose &pose) {
+	if (not map_writer_.IsOpen()) return;
+	const KeyframeRecord record = {pose.loc.x(), pose.loc.y(), pose.angle,
+	                               scan.range_min, scan.range_max,
+	                               scan.angle_min, scan.angle_max,
+	                               static_cast<uint32_t>(scan.ranges.size())};
+	map_writer_.WriteKeyframe(record, scan.ranges.data());
+}
+
+void SLAM::AddScanToMap(const LaserScan &scan, const Pose &pose, int hits) {
 	// Reconstruct the map as a single aligned point cloud from all saved poses
 	// and their respective scans.
-	const int num_ranges = current_scan_.ranges.size();
-	const float angle_increment = (current_scan_.angle_max - current_scan_.angle_min) / num_ranges;
+	const int num_ranges = scan.ranges.size();
+	const float angle_increment = (scan.angle_max - scan.angle_min) / num_ranges;
 
-	// Transform scan ranges to pose frame
+	// Transform scan ranges to pose frame, and merge the hits into the cells
+	// they fall in, logging each cell once per map version
 	for(int i = 0; i<num_ranges; i++)
 	{
-		const float range_i = current_scan_.ranges[i];
-		const float angle_i = CSM_pose.angle + current_scan_.angle_min + angle_increment * i;
-		const float point_i_x = CSM_pose.loc.x() + range_i*cos(angle_i);
-		const float point_i_y = CSM_pose.loc.y() + range_i*sin(angle_i);
+		const float range_i = scan.ranges[i];
+		// Readings at the limits of the sensor did not hit anything
+		if (range_i <= scan.range_min or range_i >= scan.range_max) continue;
+		const float angle_i = pose.angle + scan.angle_min + angle_increment * i;
+		const float point_i_x = pose.loc.x() + range_i*cos(angle_i);
+		const float point_i_y = pose.loc.y() + range_i*sin(angle_i);
 		const Vector2f point_i(point_i_x, point_i_y);
-		map_scans_.push_back(point_i);
+
+		const uint64_t key = MapCellKey(point_i);
+		MapCell &cell = map_cells_.insert(std::make_pair(key, MapCell({{0, 0}, 0, 0}))).first->second;
+		cell.sum += static_cast<float>(hits) * point_i;
+		cell.hits += hits;
+		if (cell.version != map_version_){
+			cell.version = map_version_;
+			map_changes_.push_back(std::make_pair(map_version_, key));
+		}
+	}
+}
+
+void SLAM::CompactMapChanges() {
+	// Compact the log to the last change of each cell, which keeps it in order
+	if (map_changes_.size() > 2 * map_cells_.size()){
+		size_t num_kept = 0;
+		for (const auto &change : map_changes_){
+			if (map_cells_.find(change.second)->second.version == change.first){
+				map_changes_[num_kept++] = change;
+			}
+		}
+		map_changes_.resize(num_kept);
+	}
+}
+
+uint64_t SLAM::MapCellKey(const Vector2f &loc) const {
+	return CellKey(loc, map_res_);
+}
+
+uint64_t SLAM::GetMap(size_t max_points, vector<Vector2f>* points) {
+	points->clear();
+	std::lock_guard<std::mutex> lock(map_mutex_);
+	if (max_points == 0) return map_version_;
+	// Visit every stride-th bucket of the hash table instead of every cell.
+	// Which bucket a cell is in does not depend on where it is, so the sample
+	// covers the whole map.
+	const size_t stride = std::max<size_t>(1, map_cells_.size() / max_points);
+	for (size_t b = 0; b < map_cells_.bucket_count() and points->size() < max_points; b += stride){
+		for (auto entry = map_cells_.begin(b); entry != map_cells_.end(b); ++entry){
+			const MapCell &cell = entry->second;
+			if (cell.hits >= map_min_hits_) points->push_back(cell.sum / cell.hits);
+		}
+	}
+	if (points->size() > max_points) points->resize(max_points);
+	return map_version_;
+}
+
+bool SLAM::StartRecording(const string& file) {
+	// Keyframe poses chunks index keyframes by their position in the pose
+	// graph, which must then be their position in the file too
+	size_t num_recorded = 0;
+	{
+		MapFile existing;
+		if (existing.Load(file)) num_recorded = existing.NumKeyframes();
+	}
+	const size_t num_keyframes = pose_graph_.NumNodes();
+	if (num_recorded != 0 and num_recorded != num_keyframes){
+		fprintf(stderr, "ERROR: %s holds %lu keyframes, not the %lu loaded\n",
+		        file.c_str(), num_recorded, num_keyframes);
+		return false;
 	}
+	if (not map_writer_.Open(file)) return false;
+	std::lock_guard<std::mutex> lock(map_mutex_);
+	for (size_t i = num_recorded; i < num_keyframes; i++){
+		RecordKeyframe(keyframe_scans_[i], KeyframePose(i));
+	}
+	return true;
 }
 
-vector<Vector2f> SLAM::GetMap() {
-	int jump_size = ceil(map_scans_.size() / 5000);
-	int N = std::min(int(map_scans_.size()), 5000);
-	vector<Vector2f> output_vector(N);
+void SLAM::StopRecording() {
+	if (not map_writer_.IsOpen()) return;
+	{
+		std::lock_guard<std::mutex> lock(map_mutex_);
+		vector<MapCellRecord> cells;
+		cells.reserve(map_cells_.size());
+		for (const auto &entry : map_cells_){
+			const MapCell &cell = entry.second;
+			// Cells emptied by moving keyframes
+			if (cell.hits <= 0) continue;
+			cells.push_back({entry.first, cell.sum.x(), cell.sum.y(), cell.hits, 0});
+		}
+		const MapCellsRecord map_cells = {map_res_, static_cast<uint32_t>(cells.size())};
+		map_writer_.WriteMapCells(map_cells, cells.data());
+	}
+	map_writer_.Close();
+}
+
+// The map is restored from the last map snapshot in the file, with the hits
+// of any keyframes after it added back. Only the last submap window of
+// keyframes is inserted into submaps. The loaded keyframes are held fixed in
+// the pose graph, loops can still close with them.
+bool SLAM::LoadMap(const string& file) {
+	if (map_writer_.IsOpen()){
+		fprintf(stderr, "ERROR: Load a map before recording\n");
+		return false;
+	}
+	const double t_start = GetMonotonicTime();
+	MapFile map_file;
+	if (not map_file.Load(file) or map_file.NumKeyframes() == 0) return false;
 
-	for (int i = 0; i < N; i++){
-		output_vector[i] = map_scans_[i * jump_size];
+	size_t num_in_snapshot = 0;
+	const MapCellRecord* cells = NULL;
+	const MapCellsRecord* map_cells = map_file.GetMapCells(&cells, &num_in_snapshot);
+	{
+		std::lock_guard<std::mutex> lock(map_mutex_);
+		map_cells_.clear();
+		map_changes_.clear();
+		map_version_ = 1;
+		if (map_cells != NULL and map_cells->resolution == map_res_){
+			map_cells_.reserve(map_cells->num_cells);
+			map_changes_.reserve(map_cells->num_cells);
+			for (uint32_t i = 0; i < map_cells->num_cells; i++){
+				const MapCellRecord &cell = cells[i];
+				map_cells_[cell.key] = MapCell({{cell.sum_x, cell.sum_y}, cell.hits, map_version_});
+				map_changes_.push_back(std::make_pair(map_version_, cell.key));
+			}
+		} else {
+			num_in_snapshot = 0;
+		}
+	}
+
+	const size_t num_keyframes = map_file.NumKeyframes();
+	vector<Pose> poses(num_keyframes);
+	for (size_t i = 0; i < num_keyframes; i++){
+		const float* ranges = NULL;
+		const KeyframeRecord &record = map_file.GetKeyframe(i, &ranges);
+		poses[i] = {{record.x, record.y}, record.angle};
+	}
+	// Poses from loop closures replace the recorded ones, in file order
+	for (size_t k = 0; k < map_file.NumKeyframePoses(); k++){
+		const KeyframePoseRecord* records = NULL;
+		const KeyframePosesRecord &keyframe_poses = map_file.GetKeyframePoses(k, &records);
+		for (uint32_t j = 0; j < keyframe_poses.num_poses and keyframe_poses.first + j < num_keyframes; j++){
+			poses[keyframe_poses.first + j] = {{records[j].x, records[j].y}, records[j].angle};
+		}
+	}
+
+	const size_t window = submap_keyframes_;
+	const size_t first_in_submaps = (num_keyframes > window) ? num_keyframes - window : 0;
+	pose_graph_.Clear();
+	keyframe_scans_.clear();
+	keyframe_descriptors_.Clear();
+	keyframe_cells_.clear();
+	submaps_.clear();
+	matching_submap_ = 0;
+	for (size_t i = 0; i < num_keyframes; i++){
+		const float* ranges = NULL;
+		const KeyframeRecord &record = map_file.GetKeyframe(i, &ranges);
+		MLE_pose_ = poses[i];
+		current_scan_ = LaserScan({vector<float>(ranges, ranges + record.num_ranges),
+		                           record.range_min, record.range_max, record.angle_min, record.angle_max});
+		pose_graph_.AddNode(PoseVector(MLE_pose_));
+		keyframe_scans_.push_back(current_scan_);
+		keyframe_descriptors_.Add(current_scan_.ranges, current_scan_.range_min, current_scan_.range_max);
+		IndexKeyframe(i, MLE_pose_.loc, true);
+		if (i >= num_in_snapshot) updateMap(MLE_pose_);
+		if (i >= first_in_submaps) applyScan(current_scan_, i);
+	}
+	num_fixed_keyframes_ = num_keyframes;
+	last_loop_closure_attempt_ = num_keyframes;
+	start_pose_ = MLE_pose_;
+	printf("Loaded %lu keyframes and %lu map cells from %s in %.1f ms\n",
+	       num_keyframes, map_cells_.size(), file.c_str(), 1000*(GetMonotonicTime() - t_start));
+	return true;
+}
+
+uint64_t SLAM::GetMapChanges(uint64_t since, vector<MapChange>* changes) {
+	std::lock_guard<std::mutex> lock(map_mutex_);
+	changes->clear();
+	auto change = std::upper_bound(map_changes_.begin(), map_changes_.end(),
+	                               std::make_pair(since, std::numeric_limits<uint64_t>::max()));
+	for (; change != map_changes_.end(); ++change){
+		const MapCell &cell = map_cells_.find(change->second)->second;
+		// Skip all but the last change of each cell
+		if (cell.version != change->first) continue;
+		if (cell.hits >= map_min_hits_){
+			changes->push_back({change->second, cell.sum / cell.hits, false});
+		} else if (since > 0){
+			// Too few hits, which the cell may have had enough of at since
+			changes->push_back({change->second, {0, 0}, true});
+		}
 	}
-	return output_vector;
+	return map_version_;
 }
 
 }  // namespace slam
@@ -19,14 +19,28 @@
 */
 //========================================================================
 
+#include <stdint.h>
+
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include "eigen3/Eigen/Dense"
 #include "eigen3/Eigen/Geometry"
 
+#include "shared/util/random.h"
+#include "shared/util/seqlock.h"
+
 // Custom Class
 #include "CellGrid.h"
+#include "map_file.h"
+#include "pose_graph.h"
+#include "scan_descriptor.h"
 
 #ifndef SRC_SLAM_H_
 #define SRC_SLAM_H_
@@ -51,12 +65,76 @@ struct LaserScan{
   float angle_max;
 };
 
+// Laser hits that fell in one cell of the map
+struct MapCell{
+  Eigen::Vector2f sum;   // Sum of the hit locations
+  int hits;
+  uint64_t version;      // Map version of the last hit
+};
+
+// Change to a cell of the map since some map version: its new mean hit
+// location, or its removal once it has too few hits to be occupied
+struct MapChange{
+  uint64_t key;            // Cell key, the same for every change to the cell
+  Eigen::Vector2f point;   // Mean hit location, unless removed
+  bool removed;
+};
+
+// Probability grid of the keyframes inserted since it was started, in the
+// frame of the robot at the first of them
+struct Submap{
+  Pose pose;   // Pose of the grid's frame in the map frame
+  CellGrid grid;
+  int num_keyframes;
+  int keyframe;   // Index of the first keyframe, whose pose the submap follows
+};
+
+// Pose of a particle at a keyframe, linked to its pose at the keyframe before.
+// Particles resampled from the same one share their trajectory up to there.
+struct TrajectoryNode{
+  Pose pose;
+  int keyframe;
+  std::shared_ptr<const TrajectoryNode> previous;
+};
+
+// A hypothesis of the trajectory, with the map of the scans along it
+struct Particle{
+  Pose pose;
+  double log_weight;
+  Submap map;   // Lookup table in the map frame, its tiles shared with other particles until written
+  std::shared_ptr<const TrajectoryNode> trajectory;
+};
+
+// A laser scan queued for the backend, with the odometry it was taken at
+struct Keyframe{
+  LaserScan scan;
+  Eigen::Vector2f odom_loc;
+  float odom_angle;
+};
+
+// Latest pose found by the backend, with the odometry of its keyframe
+struct PoseCorrection{
+  Pose pose;
+  Eigen::Vector2f odom_loc;
+  float odom_angle;
+};
+
+// The front end, ObserveOdometry, ObserveLaser, GetPose and GetMap, is called
+// from one thread and never waits on scan matching. Keyframes are matched and
+// added to the map by a backend thread owned by the SLAM object.
 class SLAM {
  public:
-  // Default Constructor.
+  // Default Constructor, starts the backend.
   SLAM();
+  // Stops the backend, dropping queued keyframes.
+  ~SLAM();
+
+  // Stop the backend once it has processed the keyframes queued so far, or
+  // right after the keyframe in progress. Keyframes observed afterwards are
+  // not processed.
+  void StopBackend(bool process_queued);
 
-  // Observe a new laser scan.
+  // Observe a new laser scan, queueing it for the backend if it is a keyframe.
   void ObserveLaser(const std::vector<float>& ranges,
                     float range_min,
                     float range_max,
@@ -64,8 +142,8 @@ class SLAM {
                     float angle_max,
                     amrl_msgs::VisualizationMsg &viz);
 
-  // does what the name says it does
-  Eigen::Vector2f TransformNewScanToPrevPose(const Eigen::Vector2f scan_loc, Pose odom_pose_cur);
+  // Transform a point of a scan taken at pose_cur into the frame of ref_pose
+  Eigen::Vector2f TransformNewScanToPrevPose(const Eigen::Vector2f scan_loc, Pose pose_cur, Pose ref_pose) const;
 
   // Observe new odometry-reported location.
   void ObserveOdometry(const Eigen::Vector2f& odom_loc,
@@ -73,12 +151,31 @@ class SLAM {
 
   // Update map
   void updateMap(Pose pose);
-  // Get latest map.
-  std::vector<Eigen::Vector2f> GetMap();
+  // Get the mean hit locations of up to max_points occupied map cells, spread
+  // over the whole map, and return the map version. Only about max_points
+  // cells are looked at, so the backend is not held up for longer by large
+  // maps.
+  uint64_t GetMap(size_t max_points, std::vector<Eigen::Vector2f>* points);
+  // Get the last change of every map cell hit after map version since, and
+  // return the current map version. Applying the changes in order, keyed by
+  // cell, to the map as of since gives the map as of the returned version.
+  // Versions start at 1, so since = 0 gives the whole map, with no removals.
+  uint64_t GetMapChanges(uint64_t since, std::vector<MapChange>* changes);
 
-  // Get latest robot pose.
+  // Get latest robot pose, the backend's latest pose extrapolated by odometry.
   void GetPose(Eigen::Vector2f* loc, float* angle) const;
 
+  // Append keyframes to a map file as they are added to the map, and the map
+  // itself when recording stops. The file is written on a background thread.
+  // After LoadMap, a new file starts with a copy of the loaded keyframes, so
+  // that it holds the whole map; an existing file must be the loaded one.
+  bool StartRecording(const std::string& file);
+  void StopRecording();
+  // Resume from a map file: restore its keyframe poses, map and submaps, and
+  // continue from its last keyframe. Call before the first observation and
+  // before StartRecording.
+  bool LoadMap(const std::string& file);
+
   // Convert a laser scan to a point cloud
   std::vector<Eigen::Vector2f>* Scan2MapCloud(const LaserScan &s) const;
   std::vector<Eigen::Vector2f>* Scan2BaseLinkCloud(const LaserScan &s) const;
@@ -86,20 +183,113 @@ class SLAM {
   // Get distribution of possible robot poses
   void ApplyMotionModel(Eigen::Vector2f loc, float angle, float dist_traveled, float angle_diff);
 
-  // Store a scan as a prior in the probability grid
-  void applyScan(LaserScan s);
+  // Store a scan of the given keyframe, taken at MLE_pose_, as a prior in the
+  // active submaps
+  void applyScan(LaserScan s, int keyframe);
 
-  // Apply Correlative Scan Matching Algorithm
-  Pose ApplyCSM(LaserScan s);
+  // Apply Correlative Scan Matching Algorithm against the matching submap,
+  // and optionally get the covariance of the pose
+  Pose ApplyCSM(LaserScan s, Eigen::Matrix3f* covariance);
+  // Same result as ApplyCSM, evaluating a fraction of the candidates
+  Pose ApplyBranchAndBoundCSM(LaserScan s, Eigen::Matrix3f* covariance);
+  // Refine a CSM pose against a submap below the resolution of the candidate lattice
+  Pose RefineCSMPose(LaserScan s, const Submap &submap, Pose pose);
 
  private:
+  // Backend thread and keyframe processing
+  void RunBackend();
+  void ProcessKeyframe(const Keyframe &keyframe);
+
+  // Submap that new scans are matched against
+  const Submap &MatchingSubmap() const { return submaps_[matching_submap_]; }
+
+  // Candidate poses of the motion model around a predicted pose
+  void MotionModelLattice(Pose predicted, float dist_traveled, float angle_diff,
+                          std::vector<PoseWithLikelihood>* candidates) const;
+  // Candidate poses on a lattice of nx x ny x nt around a pose, scaled to the
+  // given standard deviations
+  void SearchLattice(Pose center, float x_stddev, float y_stddev, float t_stddev,
+                     int nx, int ny, int nt,
+                     std::vector<PoseWithLikelihood>* candidates) const;
+
+  // Score every candidate pose of a scan against a submap on up to
+  // num_threads threads, returning the index of the best and its laser scan
+  // cost
+  int MatchScan(const std::vector<Eigen::Vector2f> &base_link_scan,
+                const Submap &submap,
+                const std::vector<PoseWithLikelihood> &candidates,
+                int num_threads,
+                std::vector<float>* pose_costs,
+                float* best_laser_scan_cost) const;
+
+  // Submap grids
+  void ClearSubmapGrid(CellGrid* grid) const;
+  void InsertScan(Submap* submap, const LaserScan &scan, const Pose &pose) const;
+  void InsertScan(Submap* submap, const std::vector<Eigen::Vector2f> &base_link_points, const Pose &pose) const;
+  // The two steps of InsertScan: the points of a scan taken at a pose in the
+  // frame of a submap, and adding such points to its grid
+  void SubmapPoints(const Submap &submap, const std::vector<Eigen::Vector2f> &base_link_points,
+                    const Pose &pose, std::vector<Eigen::Vector2f>* points) const;
+  void InsertSubmapPoints(Submap* submap, const std::vector<Eigen::Vector2f> &points) const;
+  // RefineCSMPose of base link points, already trimmed
+  Pose RefineMatch(const std::vector<Eigen::Vector2f> &points, const Submap &submap, Pose pose) const;
+
+  // Scan matching helpers
+  void CSMTranslationOffsets(const Submap &submap,
+                             const std::vector<PoseWithLikelihood> &candidates,
+                             std::vector<Eigen::Vector2i>* offsets) const;
+  void RotatedScanCells(const Submap &submap,
+                        const std::vector<Eigen::Vector2f> &base_link_scan,
+                        float angle,
+                        std::vector<Eigen::Vector2i>* cells) const;
+  float CSMLaserScanCost(const CellGrid &grid,
+                         const std::vector<Eigen::Vector2i> &scan_cells,
+                         const Eigen::Vector2i &offset) const;
+  float CSMPoseCost(float laser_scan_cost, float log_likelihood, int scan_size) const;
+  Eigen::Matrix3f CSMCovariance(const std::vector<PoseWithLikelihood> &candidates,
+                                const std::vector<float> &pose_costs,
+                                int best) const;
+
+  // Pose graph of the keyframes
+  Pose KeyframePose(int i) const;
+  void AddPoseGraphEdge(int from, int to, Pose to_pose, const Eigen::Matrix3f &covariance);
+  void IndexKeyframe(int i, const Eigen::Vector2f &loc, bool add);
+  bool CloseLoop();
+  bool MatchLoopClosure(int candidate);
+  void OptimizePoseGraph(int first);
+  void MoveKeyframes(int first, const std::vector<Pose> &old_poses);
+
+  // Rao-Blackwellized particle filter, used instead of the submaps and loop
+  // closure when rbpf_particles_ > 0
+  void InitializeParticles();
+  Pose UpdateParticles(const Keyframe &keyframe, Eigen::Matrix3f* covariance);
+  void ResampleParticles();
+  void FollowTrajectory(std::shared_ptr<const TrajectoryNode> node);
+
+  // Add (hits = 1) or remove (hits = -1) the hits of a scan taken at a pose.
+  // Called with map_mutex_ held.
+  void AddScanToMap(const LaserScan &scan, const Pose &pose, int hits);
+  void CompactMapChanges();
+  // Append a keyframe to the map file, if recording
+  void RecordKeyframe(const LaserScan &scan, const Pose &pose);
+
+  // Hash key of the map cell containing a location
+  uint64_t MapCellKey(const Eigen::Vector2f &loc) const;
 
   // Tuning parameters
   float observation_likelihood_res_;
   float observation_likelihood_std_dev_;
+  bool distance_transform_table_;
   float motion_model_weight_;
   float laser_scan_weight_;
   int CSM_scan_offset_;
+  bool branch_and_bound_CSM_;
+  int CSM_num_threads_;
+  int CSM_pyramid_levels_;
+  bool refine_CSM_;
+  int refine_iterations_;
+  int refine_scan_offset_;
+  float refine_loss_scale_;
   float x_res_;
   float y_res_;
   float t_res_;
@@ -109,28 +299,102 @@ class SLAM {
   float k4_;
   float linear_diff_threshold_;
   float angular_diff_threshold_;
+  size_t max_queued_keyframes_;
+  float map_res_;
+  int map_min_hits_;
+  int submap_keyframes_;
+  float submap_range_;
+  float submap_size_;
+  float CSM_min_translation_std_dev_;
+  float CSM_min_angle_std_dev_;
+  bool loop_closure_;
+  float loop_closure_radius_;
+  float descriptor_max_range_;
+  int loop_closure_descriptor_candidates_;
+  int loop_closure_max_descriptor_distance_;
+  float loop_closure_max_distance_;
+  int loop_closure_min_separation_;
+  int loop_closure_interval_;
+  int loop_closure_neighbors_;
+  float loop_closure_window_xy_;
+  float loop_closure_window_angle_;
+  float loop_closure_lattice_xy_;
+  float loop_closure_lattice_angle_;
+  float loop_closure_inlier_cost_;
+  float loop_closure_min_inliers_;
+  int pose_graph_window_;
+  int pose_graph_iterations_;
+  int rbpf_particles_;
+  float rbpf_map_res_;
+  float rbpf_map_size_;
+  float rbpf_resample_threshold_;
 
-  // Previous odometry-reported locations.
+  // Front end: pose of the first keyframe, and latest and previous keyframe's
+  // odometry-reported locations.
+  Pose start_pose_;
+  Eigen::Vector2f odom_loc_;
+  float odom_angle_;
   Eigen::Vector2f prev_odom_loc_;
   float prev_odom_angle_;
   bool odom_initialized_;
-  Eigen::Rotation2Df R_odom2MLE_;
+  bool update_scan_;         // Flag for whether the next laser scan is a keyframe
+
+  // Keyframes waiting for the backend
+  std::deque<Keyframe> keyframes_;
+  std::mutex keyframes_mutex_;
+  std::condition_variable keyframes_cv_;
+  bool stop_backend_;
+  bool process_queued_;      // Whether the backend empties the queue before stopping
+  // Written only by the backend after the first keyframe, read by GetPose
+  util::SeqLock<PoseCorrection> pose_correction_;
+
+  // Backend: pose of the last keyframe and its odometry-reported location
+  bool backend_initialized_;
   Pose MLE_pose_;
-  Pose current_pose_;
+  Eigen::Vector2f MLE_odom_loc_;
+  float MLE_odom_angle_;
+  Eigen::Matrix3f MLE_covariance_;
+
+  // Keyframe poses and the constraints between them. Keyframes before
+  // num_fixed_keyframes_ came from a loaded map and are not optimized.
+  PoseGraph pose_graph_;
+  std::vector<LaserScan> keyframe_scans_;
+  ScanDescriptorIndex keyframe_descriptors_;
+  int num_fixed_keyframes_;
+  // Keyframes by loop_closure_radius_ sized cell of their location
+  std::unordered_map<uint64_t, std::vector<int> > keyframe_cells_;
+  int last_loop_closure_attempt_;
+  Submap loop_closure_submap_;   // Grid of the keyframes around a loop closure candidate
+  std::vector<PoseWithLikelihood> loop_closure_poses_;
 
   // Storing scans
   LaserScan current_scan_;   // Current scan for SLAM algorithm to use
-  bool update_scan_;         // Flag for whether or not to update the SLAM map
 
   // Motion model variables
   std::vector<PoseWithLikelihood> possible_poses_;
 
-  // Rasterized grid
-  CellGrid prob_grid_;
-  bool prob_grid_init_;   // Flag to fix vizualization bug where the entire grid is shown on startup
+  // Submaps, oldest first. Scans are inserted into the matching submap and
+  // the newer, active, one; older submaps are frozen and their grids released.
+  std::vector<Submap> submaps_;
+  size_t matching_submap_;
+  CellGrid spare_grid_;   // Grid of the last frozen submap, reused by the next new one
+  std::vector<CellGrid> prob_grid_pyramid_;   // Element k holds maxima over blocks of 2^(k+1) x 2^(k+1) cells of the matching submap's grid
+
+  // Map cells with at least one hit, so memory grows with the area explored
+  std::unordered_map<uint64_t, MapCell> map_cells_;
+  uint64_t map_version_;   // Incremented by every updateMap
+  // (version, cell key) of map cell hits, oldest first. Holds at least the
+  // last version of every cell, older entries are dropped once they outnumber
+  // the cells.
+  std::vector<std::pair<uint64_t, uint64_t> > map_changes_;
+  std::mutex map_mutex_;   // Guards the map, which the backend adds to
+  MapFileWriter map_writer_;
+
+  // Particles of the Rao-Blackwellized particle filter
+  std::vector<Particle> particles_;
+  util_random::Random particle_rng_;
 
-  // Map vector
-  std::vector<Eigen::Vector2f> map_scans_;
+  std::thread backend_;   // Started last, once the members it uses exist
 };
 
 }  // namespace slam
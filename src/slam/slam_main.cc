@@ -26,6 +26,8 @@
 #include <string.h>
 #include <inttypes.h>
 #include <termios.h>
+#include <algorithm>
+#include <string>
 #include <vector>
 
 #include "eigen3/Eigen/Dense"
@@ -69,15 +71,26 @@ using visualization::DrawParticle;
 // Create command line arguements
 DEFINE_string(laser_topic, "/scan", "Name of ROS topic for LIDAR data");
 DEFINE_string(odom_topic, "/odom", "Name of ROS topic for odometry data");
+DEFINE_int32(map_snapshot_period, 10,
+    "Map publishes per full map snapshot, only changes are published between");
+DEFINE_int32(map_snapshot_points, 10000, "Most points in a full map snapshot");
+DEFINE_string(load_map, "", "Map file to resume mapping from");
+DEFINE_string(save_map, "",
+    "Map file to record keyframes and the map to, appended to if it exists");
 
 DECLARE_int32(v);
 
 bool run_ = true;
-slam::SLAM slam_;
+// Created in main, after the flags are parsed, as it starts a thread.
+slam::SLAM* slam_ = nullptr;
 ros::Publisher visualization_publisher_;
 ros::Publisher localization_publisher_;
 VisualizationMsg vis_msg_;
 VisualizationMsg grid_msg_;
+// Map changes between snapshots, one namespace per publish, so that the
+// viewer, which keeps the latest message of each namespace, shows them all.
+vector<VisualizationMsg> map_update_msgs_;
+uint64_t published_map_version_ = 0;
 sensor_msgs::LaserScan last_laser_msg_;
 
 void InitializeMsgs() {
@@ -87,10 +100,22 @@ void InitializeMsgs() {
 
   vis_msg_ = visualization::NewVisualizationMessage("map", "slam");
   grid_msg_ = visualization::NewVisualizationMessage("base_link", "slam_local");
+  map_update_msgs_.clear();
+  for (int i = 1; i < FLAGS_map_snapshot_period; ++i) {
+    map_update_msgs_.push_back(visualization::NewVisualizationMessage(
+        "map", "slam_map_update_" + std::to_string(i)));
+  }
 }
 
+// Publishes a snapshot of at most --map_snapshot_points map points every
+// --map_snapshot_period publishes, and in between only the points of the map
+// cells changed since the last publish, so that neither grows with the size
+// of the map. The changes of the previous period stay in the viewer until
+// their namespace is reused, which also shows cells the snapshot left out.
+// Cells that moved or were removed are left where they were until then.
 void PublishMap() {
   static double t_last = 0;
+  static size_t num_publishes = 0;
   if (GetMonotonicTime() - t_last < 0.5) {
     // Rate-limit visualization.
     ClearVisualizationMsg(vis_msg_);
@@ -98,22 +123,38 @@ void PublishMap() {
     return;
   }
   t_last = GetMonotonicTime();
-  vis_msg_.header.stamp = ros::Time::now();
-  ClearVisualizationMsg(vis_msg_);
-
-  const vector<Vector2f> map = slam_.GetMap();
-  printf("Map: %lu points\n", map.size());
-  for (const Vector2f& p : map) {
-    visualization::DrawPoint(p, 0xC0C0C0, vis_msg_);
+  const size_t update = num_publishes++ % (map_update_msgs_.size() + 1);
+  if (update == 0) {
+    vis_msg_.header.stamp = ros::Time::now();
+    ClearVisualizationMsg(vis_msg_);
+    static vector<Vector2f> map;
+    published_map_version_ =
+        slam_->GetMap(std::max(0, FLAGS_map_snapshot_points), &map);
+    printf("Map: %lu points\n", map.size());
+    for (const Vector2f& p : map) {
+      visualization::DrawPoint(p, 0xC0C0C0, vis_msg_);
+    }
+    visualization_publisher_.publish(vis_msg_);
+  } else {
+    VisualizationMsg& update_msg = map_update_msgs_[update - 1];
+    update_msg.header.stamp = ros::Time::now();
+    ClearVisualizationMsg(update_msg);
+    static vector<slam::MapChange> changes;
+    published_map_version_ =
+        slam_->GetMapChanges(published_map_version_, &changes);
+    for (const slam::MapChange& change : changes) {
+      if (change.removed) continue;
+      visualization::DrawPoint(change.point, 0xC0C0C0, update_msg);
+    }
+    visualization_publisher_.publish(update_msg);
   }
-  visualization_publisher_.publish(vis_msg_);
   visualization_publisher_.publish(grid_msg_);
 }
 
 void PublishPose() {
   Vector2f robot_loc(0, 0);
   float robot_angle(0);
-  slam_.GetPose(&robot_loc, &robot_angle);
+  slam_->GetPose(&robot_loc, &robot_angle);
   amrl_msgs::Localization2DMsg localization_msg;
   localization_msg.pose.x = robot_loc.x();
   localization_msg.pose.y = robot_loc.y();
@@ -127,7 +168,7 @@ void LaserCallback(const sensor_msgs::LaserScan& msg) {
   }
   last_laser_msg_ = msg;
   ClearVisualizationMsg(grid_msg_);
-  slam_.ObserveLaser(
+  slam_->ObserveLaser(
       msg.ranges,
       msg.range_min,
       msg.range_max,
@@ -135,7 +176,6 @@ void LaserCallback(const sensor_msgs::LaserScan& msg) {
       msg.angle_max,
       grid_msg_);
   PublishMap();
-  PublishPose();
 }
 
 void OdometryCallback(const nav_msgs::Odometry& msg) {
@@ -145,12 +185,25 @@ void OdometryCallback(const nav_msgs::Odometry& msg) {
   const Vector2f odom_loc(msg.pose.pose.position.x, msg.pose.pose.position.y);
   const float odom_angle =
       2.0 * atan2(msg.pose.pose.orientation.z, msg.pose.pose.orientation.w);
-  slam_.ObserveOdometry(odom_loc, odom_angle);
+  slam_->ObserveOdometry(odom_loc, odom_angle);
+  // Scan matching runs in the background, so the pose is published at the
+  // odometry rate.
+  PublishPose();
 }
 
 
 int main(int argc, char** argv) {
   google::ParseCommandLineFlags(&argc, &argv, false);
+  slam_ = new slam::SLAM();
+  if (!FLAGS_load_map.empty() && !slam_->LoadMap(FLAGS_load_map)) {
+    fprintf(stderr, "ERROR: Unable to load map %s\n", FLAGS_load_map.c_str());
+    delete slam_;
+    return 1;
+  }
+  if (!FLAGS_save_map.empty() && !slam_->StartRecording(FLAGS_save_map)) {
+    delete slam_;
+    return 1;
+  }
   // Initialize ROS.
   ros::init(argc, argv, "slam");
   ros::NodeHandle n;
@@ -170,6 +223,11 @@ int main(int argc, char** argv) {
       1,
       OdometryCallback);
   ros::spin();
+  // Finish the keyframes already observed, so that the recorded map includes
+  // them and the backend no longer adds to it while it is written.
+  slam_->StopBackend(true);
+  slam_->StopRecording();
+  delete slam_;
 
   return 0;
 }
@@ -0,0 +1,108 @@
+// This software is free: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License Version 3,
+// as published by the Free Software Foundation.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// Version 3 in the file COPYING that came with this distribution.
+// If not, see <http://www.gnu.org/licenses/>.
+// ========================================================================
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <vector>
+
+#include "eigen3/Eigen/Dense"
+#include "gflags/gflags.h"
+
+#include "particle_filter/particle_filter.h"
+#include "vector_map/vector_map.h"
+
+DECLARE_bool(kld_sampling);
+DECLARE_int32(kld_max_particles);
+DECLARE_double(resample_ess_fraction);
+DECLARE_double(num_particles);
+
+using Eigen::Vector2f;
+using particle_filter::Particle;
+using particle_filter::ParticleFilter;
+using std::vector;
+using vector_map::VectorMap;
+
+namespace {
+
+// Laser parameters of the car.
+const int kNumRanges = 1081;
+const float kRangeMin = 0.02;
+const float kRangeMax = 10;
+const float kAngleMin = -2.25;
+const float kAngleMax = 2.25;
+
+// Drives down the corridor of GDC1 with exact scans, updating the filter
+// every 10 cm. Returns the final pose in loc and angle. Run from the root of
+// the repository, where the maps are.
+void Drive(ParticleFilter* pf, int num_updates, Vector2f* loc, float* angle) {
+  VectorMap map("maps/GDC1.txt");
+  *loc = Vector2f(14.7, 14.24);
+  *angle = 0;
+  pf->Initialize("GDC1", *loc, *angle);
+  pf->ObserveOdometry(*loc, *angle);
+  vector<float> ranges;
+  for (int i = 0; i < num_updates; ++i) {
+    *loc += Vector2f(0.15 * cos(*angle), 0.15 * sin(*angle));
+    *angle += 0.01;
+    pf->ObserveOdometry(*loc, *angle);
+    const Vector2f lidar = *loc + 0.2 * Vector2f(cos(*angle), sin(*angle));
+    map.GetPredictedScan(lidar, kRangeMin, kRangeMax, *angle + kAngleMin,
+                         *angle + kAngleMax, kNumRanges, &ranges);
+    pf->ObserveLaser(ranges, kRangeMin, kRangeMax, kAngleMin, kAngleMax);
+  }
+}
+
+}  // namespace
+
+// The weights never degenerate enough to resample, but the belief converges
+// and KLD-sampling still shrinks the set.
+TEST(ParticleFilter, KLDSamplingShrinksConvergedSet) {
+  const bool kld_sampling = FLAGS_kld_sampling;
+  const double resample_ess_fraction = FLAGS_resample_ess_fraction;
+  FLAGS_kld_sampling = true;
+  FLAGS_resample_ess_fraction = 0;
+  ParticleFilter pf;
+  Vector2f loc;
+  float angle = 0;
+  vector<Particle> particles;
+
+  Drive(&pf, 0, &loc, &angle);
+  pf.GetParticles(&particles);
+  EXPECT_EQ(static_cast<size_t>(FLAGS_kld_max_particles), particles.size());
+
+  Drive(&pf, 20, &loc, &angle);
+  pf.GetParticles(&particles);
+  EXPECT_LT(particles.size(), FLAGS_kld_max_particles / 4u);
+  Vector2f estimated_loc;
+  float estimated_angle = 0;
+  pf.GetLocation(&estimated_loc, &estimated_angle);
+  EXPECT_LT((estimated_loc - loc).norm(), 0.5);
+
+  FLAGS_kld_sampling = kld_sampling;
+  FLAGS_resample_ess_fraction = resample_ess_fraction;
+}
+
+TEST(ParticleFilter, FixedSetSizeWithoutKLDSampling) {
+  const bool kld_sampling = FLAGS_kld_sampling;
+  FLAGS_kld_sampling = false;
+  ParticleFilter pf;
+  Vector2f loc;
+  float angle = 0;
+  Drive(&pf, 20, &loc, &angle);
+  vector<Particle> particles;
+  pf.GetParticles(&particles);
+  EXPECT_EQ(static_cast<size_t>(FLAGS_num_particles), particles.size());
+  FLAGS_kld_sampling = kld_sampling;
+}
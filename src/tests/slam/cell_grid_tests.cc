@@ -0,0 +1,305 @@
+// This software is free: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License Version 3,
+// as published by the Free Software Foundation.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// Version 3 in the file COPYING that came with this distribution.
+// If not, see <http://www.gnu.org/licenses/>.
+// ========================================================================
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "eigen3/Eigen/Dense"
+
+#include "shared/util/random.h"
+#include "slam/CellGrid.h"
+
+using Eigen::Vector2f;
+using std::max;
+using std::min;
+using std::vector;
+
+namespace {
+
+const float kStdDev = 0.15;
+
+// Plain row-major raster of what a CellGrid should hold, without tiles,
+// kernels or distance transforms.
+struct BruteForceGrid {
+  BruteForceGrid(const CellGrid& grid)
+      : width(grid.getXCellCount()),
+        height(grid.getYCellCount()),
+        cells(width * height, grid.getMinCost()) {}
+
+  float& at(int xi, int yi) { return cells[yi * width + xi]; }
+  float at(int xi, int yi) const { return cells[yi * width + xi]; }
+
+  // Raise every cell within min_cost of a point's cell to its Gaussian
+  // log-likelihood.
+  void applyLaserPoint(const CellGrid& grid, const Vector2f& p) {
+    int x0, y0;
+    if (not grid.tryIndex(p, &x0, &y0)) return;
+    const float resolution = grid.getResolution();
+    for (int yi = 0; yi < height; ++yi) {
+      for (int xi = 0; xi < width; ++xi) {
+        const float dx = (xi - x0) * resolution;
+        const float dy = (yi - y0) * resolution;
+        const float log_weight = -(dx * dx + dy * dy) / (kStdDev * kStdDev);
+        if (log_weight >= grid.getMinCost()) {
+          at(xi, yi) = max(at(xi, yi), log_weight);
+        }
+      }
+    }
+  }
+
+  int width;
+  int height;
+  vector<float> cells;
+};
+
+// A grid whose size is not a whole number of tiles, away from the origin.
+CellGrid MakeGrid() {
+  return CellGrid(Vector2f(-3.1, 2.2), 0.05, 5.03, 3.31);
+}
+
+vector<Vector2f> RandomPoints(const CellGrid& grid,
+                              util_random::Random* rng,
+                              int n) {
+  // Some of the points are outside the grid.
+  const Vector2f origin = grid.getOrigin();
+  vector<Vector2f> points;
+  for (int i = 0; i < n; ++i) {
+    points.push_back(Vector2f(
+        rng->UniformRandom(origin.x() - 0.3, origin.x() + grid.getWidth() + 0.3),
+        rng->UniformRandom(origin.y() - 0.3,
+                           origin.y() + grid.getHeight() + 0.3)));
+  }
+  return points;
+}
+
+void ExpectGridsNear(const BruteForceGrid& expected,
+                     const CellGrid& actual,
+                     float tolerance) {
+  ASSERT_EQ(expected.width, actual.getXCellCount());
+  ASSERT_EQ(expected.height, actual.getYCellCount());
+  for (int yi = 0; yi < expected.height; ++yi) {
+    for (int xi = 0; xi < expected.width; ++xi) {
+      ASSERT_NEAR(expected.at(xi, yi), actual.at(xi, yi), tolerance)
+          << "cell " << xi << ", " << yi;
+    }
+  }
+}
+
+// One-dimensional Catmull-Rom spline through p1 and p2.
+float CatmullRom(float p0, float p1, float p2, float p3, float t) {
+  return 0.5f * (2 * p1 + (p2 - p0) * t +
+                 (2 * p0 - 5 * p1 + 4 * p2 - p3) * t * t +
+                 (3 * p1 - p0 - 3 * p2 + p3) * t * t * t);
+}
+
+}  // namespace
+
+TEST(CellGrid, ApplyLaserPointMatchesBruteForce) {
+  util_random::Random rng(1);
+  CellGrid grid = MakeGrid();
+  BruteForceGrid expected(grid);
+  for (const Vector2f& p : RandomPoints(grid, &rng, 40)) {
+    grid.applyLaserPoint(p, kStdDev);
+    expected.applyLaserPoint(grid, p);
+  }
+  ExpectGridsNear(expected, grid, 1e-3);
+}
+
+TEST(CellGrid, ApplyLaserPointsMatchesBruteForce) {
+  util_random::Random rng(2);
+  CellGrid grid = MakeGrid();
+  BruteForceGrid expected(grid);
+  // Two scans, so that the second is blended with the first.
+  for (int scan = 0; scan < 2; ++scan) {
+    const vector<Vector2f> points = RandomPoints(grid, &rng, 40);
+    grid.applyLaserPoints(points, kStdDev);
+    for (const Vector2f& p : points) expected.applyLaserPoint(grid, p);
+  }
+  ExpectGridsNear(expected, grid, 1e-3);
+
+  // Points all outside the grid change nothing.
+  grid.applyLaserPoints(vector<Vector2f>(1, Vector2f(100, 100)), kStdDev);
+  ExpectGridsNear(expected, grid, 1e-3);
+}
+
+TEST(CellGrid, ClearAndReuse) {
+  util_random::Random rng(3);
+  CellGrid grid = MakeGrid();
+  grid.applyLaserPoints(RandomPoints(grid, &rng, 40), kStdDev);
+  grid.clear();
+  ExpectGridsNear(BruteForceGrid(grid), grid, 0);
+  EXPECT_EQ(0, grid.countUniqueTiles());
+
+  // A cleared grid is as good as a new one.
+  BruteForceGrid expected(grid);
+  for (const Vector2f& p : RandomPoints(grid, &rng, 20)) {
+    grid.applyLaserPoint(p, kStdDev);
+    expected.applyLaserPoint(grid, p);
+  }
+  ExpectGridsNear(expected, grid, 1e-3);
+}
+
+TEST(CellGrid, CopiesAreIndependent) {
+  util_random::Random rng(4);
+  CellGrid grid = MakeGrid();
+  BruteForceGrid expected(grid);
+  for (const Vector2f& p : RandomPoints(grid, &rng, 20)) {
+    grid.applyLaserPoint(p, kStdDev);
+    expected.applyLaserPoint(grid, p);
+  }
+  CellGrid copy = grid;
+  BruteForceGrid expected_copy = expected;
+  for (const Vector2f& p : RandomPoints(grid, &rng, 20)) {
+    copy.applyLaserPoint(p, kStdDev);
+    expected_copy.applyLaserPoint(grid, p);
+  }
+  copy.at(0, 0) = 1;
+  expected_copy.at(0, 0) = 1;
+  ExpectGridsNear(expected, grid, 1e-3);
+  ExpectGridsNear(expected_copy, copy, 1e-3);
+  copy.clear();
+  ExpectGridsNear(expected, grid, 1e-3);
+}
+
+// Once a copy has been made writable for some points, writing them copies no
+// more tiles, whichever way they are stamped.
+TEST(CellGrid, MakeWritableCopiesAheadOfWrites) {
+  util_random::Random rng(7);
+  CellGrid grid = MakeGrid();
+  BruteForceGrid expected(grid);
+  for (const Vector2f& p : RandomPoints(grid, &rng, 60)) {
+    grid.applyLaserPoint(p, kStdDev);
+    expected.applyLaserPoint(grid, p);
+  }
+  for (const bool batch : {false, true}) {
+    CellGrid copy = grid;
+    EXPECT_EQ(0, copy.countUniqueTiles());
+    const vector<Vector2f> points = RandomPoints(grid, &rng, 60);
+    copy.makeWritable(points, kStdDev);
+    const int num_unique = copy.countUniqueTiles();
+    EXPECT_GT(num_unique, 0);
+    BruteForceGrid expected_copy = expected;
+    if (batch) {
+      copy.applyLaserPoints(points, kStdDev);
+    } else {
+      for (const Vector2f& p : points) copy.applyLaserPoint(p, kStdDev);
+    }
+    for (const Vector2f& p : points) expected_copy.applyLaserPoint(grid, p);
+    EXPECT_EQ(num_unique, copy.countUniqueTiles());
+    ExpectGridsNear(expected_copy, copy, 1e-3);
+    ExpectGridsNear(expected, grid, 1e-3);
+  }
+}
+
+TEST(CellGrid, MaxPoolMatchesBruteForce) {
+  util_random::Random rng(5);
+  CellGrid grid = MakeGrid();
+  // Read through a const reference, which leaves the tiles unmarked.
+  const CellGrid& finest = grid;
+  vector<CellGrid> pyramid(4);
+  // The second pass reuses the pyramid's grids, clearing instead of
+  // resetting them.
+  for (int pass = 0; pass < 2; ++pass) {
+    grid.clear();
+    grid.applyLaserPoints(RandomPoints(grid, &rng, 10), kStdDev);
+    for (size_t k = 0; k < pyramid.size(); ++k) {
+      pyramid[k].maxPoolFrom(k == 0 ? grid : pyramid[k - 1]);
+    }
+    for (size_t k = 0; k < pyramid.size(); ++k) {
+      const CellGrid& level = pyramid[k];
+      const int scale = 2 << k;
+      ASSERT_FLOAT_EQ(grid.getResolution() * scale, level.getResolution());
+      ASSERT_EQ((grid.getXCellCount() + scale - 1) / scale,
+                level.getXCellCount());
+      ASSERT_EQ((grid.getYCellCount() + scale - 1) / scale,
+                level.getYCellCount());
+      for (int yi = 0; yi < level.getYCellCount(); ++yi) {
+        for (int xi = 0; xi < level.getXCellCount(); ++xi) {
+          float maximum = grid.getMinCost();
+          const int x_end = min(grid.getXCellCount(), (xi + 1) * scale);
+          const int y_end = min(grid.getYCellCount(), (yi + 1) * scale);
+          for (int y = yi * scale; y < y_end; ++y) {
+            for (int x = xi * scale; x < x_end; ++x) {
+              maximum = max(maximum, finest.at(x, y));
+            }
+          }
+          ASSERT_EQ(maximum, level.at(xi, yi))
+              << "level " << k << " cell " << xi << ", " << yi;
+        }
+      }
+    }
+  }
+}
+
+TEST(CellGrid, InterpolationMatchesBicubic) {
+  util_random::Random rng(6);
+  CellGrid grid = MakeGrid();
+  const int width = grid.getXCellCount();
+  const int height = grid.getYCellCount();
+  for (int yi = 0; yi < height; ++yi) {
+    for (int xi = 0; xi < width; ++xi) {
+      grid.at(xi, yi) = rng.UniformRandom(-10, 0);
+    }
+  }
+  const float resolution = grid.getResolution();
+  const Vector2f origin = grid.getOrigin();
+  const CellGrid& cells = grid;
+
+  // The values at cell centers are the cells' own.
+  Vector2f gradient;
+  for (int i = 0; i < 100; ++i) {
+    const int xi = rng.RandomInt(0, width - 1);
+    const int yi = rng.RandomInt(0, height - 1);
+    const Vector2f center =
+        origin + Vector2f(xi + 0.5, yi + 0.5) * resolution;
+    EXPECT_NEAR(cells.at(xi, yi), grid.interpolate(center, &gradient), 1e-4);
+  }
+
+  // Elsewhere, Catmull-Rom splines along x, then along y, of the cells,
+  // clamped to the edges of the grid. Some points are outside the grid.
+  auto cell = [&](int xi, int yi) {
+    return cells.at(min(width - 1, max(0, xi)), min(height - 1, max(0, yi)));
+  };
+  for (const Vector2f& p : RandomPoints(grid, &rng, 500)) {
+    const Vector2f uv = (p - origin) / resolution - Vector2f(0.5, 0.5);
+    const int x1 = std::floor(uv.x());
+    const int y1 = std::floor(uv.y());
+    float rows[4];
+    for (int j = 0; j < 4; ++j) {
+      const int yi = y1 - 1 + j;
+      rows[j] = CatmullRom(cell(x1 - 1, yi), cell(x1, yi), cell(x1 + 1, yi),
+                           cell(x1 + 2, yi), uv.x() - x1);
+    }
+    const float expected =
+        CatmullRom(rows[0], rows[1], rows[2], rows[3], uv.y() - y1);
+    const float value = grid.interpolate(p, &gradient);
+    EXPECT_NEAR(expected, value, 1e-3);
+
+    // The gradient is that of the interpolated values, by central
+    // differences a hundredth of a cell across.
+    const float h = 0.005 * resolution;
+    Vector2f unused;
+    const Vector2f dx(h, 0);
+    const Vector2f dy(0, h);
+    const float du = (grid.interpolate(p + dx, &unused) -
+                      grid.interpolate(p - dx, &unused)) / (2 * h);
+    const float dv = (grid.interpolate(p + dy, &unused) -
+                      grid.interpolate(p - dy, &unused)) / (2 * h);
+    EXPECT_NEAR(du, gradient.x(), 0.02 * (1 + std::abs(du)));
+    EXPECT_NEAR(dv, gradient.y(), 0.02 * (1 + std::abs(dv)));
+  }
+}
@@ -0,0 +1,217 @@
+// This software is free: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License Version 3,
+// as published by the Free Software Foundation.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// Version 3 in the file COPYING that came with this distribution.
+// If not, see <http://www.gnu.org/licenses/>.
+// ========================================================================
+
+#include <gtest/gtest.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "slam/map_file.h"
+
+using slam::KeyframePoseRecord;
+using slam::KeyframePosesRecord;
+using slam::KeyframeRecord;
+using slam::MapCellRecord;
+using slam::MapCellsRecord;
+using slam::MapFile;
+using slam::MapFileWriter;
+using std::string;
+using std::vector;
+
+namespace {
+
+// A file name no other test uses, removed at the end of the test.
+class TempFile {
+ public:
+  TempFile() {
+    char name[] = "/tmp/map_file_testXXXXXX";
+    const int fd = mkstemp(name);
+    if (fd >= 0) close(fd);
+    name_ = name;
+  }
+  ~TempFile() { remove(name_.c_str()); }
+  const string& name() const { return name_; }
+
+ private:
+  string name_;
+};
+
+KeyframeRecord MakeKeyframe(int i, uint32_t num_ranges) {
+  KeyframeRecord keyframe;
+  keyframe.x = i;
+  keyframe.y = -i;
+  keyframe.angle = 0.1 * i;
+  keyframe.range_min = 0.02;
+  keyframe.range_max = 10;
+  keyframe.angle_min = -2.25;
+  keyframe.angle_max = 2.25;
+  keyframe.num_ranges = num_ranges;
+  return keyframe;
+}
+
+vector<float> MakeRanges(int i, uint32_t num_ranges) {
+  vector<float> ranges;
+  for (uint32_t j = 0; j < num_ranges; ++j) ranges.push_back(i + 0.01 * j);
+  return ranges;
+}
+
+void WriteKeyframes(MapFileWriter* writer, int begin, int end) {
+  for (int i = begin; i < end; ++i) {
+    // Odd numbers of ranges leave the chunks to be padded.
+    const uint32_t num_ranges = 5 + i;
+    writer->WriteKeyframe(MakeKeyframe(i, num_ranges),
+                          MakeRanges(i, num_ranges).data());
+  }
+}
+
+void ExpectKeyframes(const MapFile& map_file, int end) {
+  ASSERT_EQ(static_cast<size_t>(end), map_file.NumKeyframes());
+  for (int i = 0; i < end; ++i) {
+    const float* ranges = NULL;
+    const KeyframeRecord& keyframe = map_file.GetKeyframe(i, &ranges);
+    const KeyframeRecord expected = MakeKeyframe(i, 5 + i);
+    EXPECT_EQ(expected.x, keyframe.x);
+    EXPECT_EQ(expected.y, keyframe.y);
+    EXPECT_EQ(expected.angle, keyframe.angle);
+    EXPECT_EQ(expected.range_max, keyframe.range_max);
+    EXPECT_EQ(expected.angle_min, keyframe.angle_min);
+    ASSERT_EQ(expected.num_ranges, keyframe.num_ranges);
+    EXPECT_EQ(MakeRanges(i, keyframe.num_ranges),
+              vector<float>(ranges, ranges + keyframe.num_ranges));
+  }
+}
+
+}  // namespace
+
+TEST(MapFile, RoundTrip) {
+  TempFile file;
+  {
+    MapFileWriter writer;
+    ASSERT_TRUE(writer.Open(file.name()));
+    EXPECT_TRUE(writer.IsOpen());
+    WriteKeyframes(&writer, 0, 4);
+
+    const KeyframePoseRecord poses[2] = {{1.5, 2.5, 0.5}, {3.5, 4.5, -0.5}};
+    const KeyframePosesRecord keyframe_poses = {1, 2};
+    writer.WriteKeyframePoses(keyframe_poses, poses);
+
+    vector<MapCellRecord> cells(3);
+    for (size_t i = 0; i < cells.size(); ++i) {
+      cells[i].key = (static_cast<uint64_t>(i) << 32) | (i + 7);
+      cells[i].sum_x = i + 0.25;
+      cells[i].sum_y = i - 0.25;
+      cells[i].hits = 2 * i + 1;
+      cells[i].reserved = 0;
+    }
+    const MapCellsRecord map_cells = {0.05, 3};
+    writer.WriteMapCells(map_cells, cells.data());
+    WriteKeyframes(&writer, 4, 5);
+    writer.Close();
+    EXPECT_FALSE(writer.IsOpen());
+  }
+
+  MapFile map_file;
+  ASSERT_TRUE(map_file.Load(file.name()));
+  ExpectKeyframes(map_file, 5);
+
+  ASSERT_EQ(1u, map_file.NumKeyframePoses());
+  const KeyframePoseRecord* poses = NULL;
+  const KeyframePosesRecord& keyframe_poses =
+      map_file.GetKeyframePoses(0, &poses);
+  EXPECT_EQ(1u, keyframe_poses.first);
+  ASSERT_EQ(2u, keyframe_poses.num_poses);
+  EXPECT_EQ(1.5, poses[0].x);
+  EXPECT_EQ(2.5, poses[0].y);
+  EXPECT_EQ(0.5, poses[0].angle);
+  EXPECT_EQ(3.5, poses[1].x);
+  EXPECT_EQ(4.5, poses[1].y);
+  EXPECT_EQ(-0.5, poses[1].angle);
+
+  const MapCellRecord* cells = NULL;
+  size_t num_keyframes_before = 0;
+  const MapCellsRecord* map_cells =
+      map_file.GetMapCells(&cells, &num_keyframes_before);
+  ASSERT_TRUE(map_cells != NULL);
+  EXPECT_EQ(4u, num_keyframes_before);
+  EXPECT_FLOAT_EQ(0.05, map_cells->resolution);
+  ASSERT_EQ(3u, map_cells->num_cells);
+  for (uint64_t i = 0; i < 3; ++i) {
+    EXPECT_EQ((i << 32) | (i + 7), cells[i].key);
+    EXPECT_EQ(i + 0.25f, cells[i].sum_x);
+    EXPECT_EQ(i - 0.25f, cells[i].sum_y);
+    EXPECT_EQ(static_cast<int32_t>(2 * i + 1), cells[i].hits);
+  }
+}
+
+TEST(MapFile, AppendsAfterLastCompleteChunk) {
+  TempFile file;
+  {
+    MapFileWriter writer;
+    ASSERT_TRUE(writer.Open(file.name()));
+    WriteKeyframes(&writer, 0, 2);
+  }
+  // Half a chunk, as a crash during a write would leave.
+  size_t valid_size = 0;
+  {
+    MapFile map_file;
+    ASSERT_TRUE(map_file.Load(file.name()));
+    valid_size = map_file.ValidSize();
+    FILE* fid = fopen(file.name().c_str(), "ab");
+    ASSERT_TRUE(fid != NULL);
+    const uint32_t partial[3] = {slam::kKeyframeChunk, 64, 0};
+    fwrite(partial, sizeof(partial), 1, fid);
+    fclose(fid);
+  }
+  {
+    MapFile map_file;
+    ASSERT_TRUE(map_file.Load(file.name()));
+    EXPECT_EQ(valid_size, map_file.ValidSize());
+    ExpectKeyframes(map_file, 2);
+  }
+  {
+    MapFileWriter writer;
+    ASSERT_TRUE(writer.Open(file.name()));
+    WriteKeyframes(&writer, 2, 3);
+  }
+  MapFile map_file;
+  ASSERT_TRUE(map_file.Load(file.name()));
+  ExpectKeyframes(map_file, 3);
+  EXPECT_EQ(0u, map_file.NumKeyframePoses());
+}
+
+TEST(MapFile, DoesNotOverwriteOtherFiles) {
+  TempFile file;
+  const string contents = "not a map file\n";
+  FILE* fid = fopen(file.name().c_str(), "wb");
+  ASSERT_TRUE(fid != NULL);
+  fwrite(contents.data(), 1, contents.size(), fid);
+  fclose(fid);
+
+  MapFileWriter writer;
+  EXPECT_FALSE(writer.Open(file.name()));
+  EXPECT_FALSE(writer.IsOpen());
+  MapFile map_file;
+  EXPECT_FALSE(map_file.Load(file.name()));
+
+  char buffer[64] = {0};
+  fid = fopen(file.name().c_str(), "rb");
+  ASSERT_TRUE(fid != NULL);
+  const size_t size = fread(buffer, 1, sizeof(buffer), fid);
+  fclose(fid);
+  EXPECT_EQ(contents, string(buffer, size));
+}
@@ -0,0 +1,120 @@
+// This software is free: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License Version 3,
+// as published by the Free Software Foundation.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// Version 3 in the file COPYING that came with this distribution.
+// If not, see <http://www.gnu.org/licenses/>.
+// ========================================================================
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <vector>
+
+#include "eigen3/Eigen/Dense"
+
+#include "shared/math/math_util.h"
+#include "slam/pose_graph.h"
+
+using Eigen::Matrix3f;
+using Eigen::Vector3f;
+using math_util::AngleDiff;
+using slam::PoseGraph;
+using std::vector;
+
+namespace {
+
+void ExpectPoseNear(const Vector3f& expected, const Vector3f& actual) {
+  EXPECT_NEAR(expected.x(), actual.x(), 1e-4);
+  EXPECT_NEAR(expected.y(), actual.y(), 1e-4);
+  EXPECT_NEAR(0, AngleDiff(expected.z(), actual.z()), 1e-4);
+}
+
+// Nodes at x = 0, 1, ..., 4 by odometry, and a loop closure from node 0 to
+// node 4 measuring 3.6 m instead of 4 m, all with the same information.
+void AddChain(PoseGraph* graph) {
+  for (int i = 0; i <= 4; ++i) graph->AddNode(Vector3f(i, 0, 0));
+  for (int i = 0; i < 4; ++i) {
+    graph->AddEdge(i, i + 1, Vector3f(1, 0, 0), Matrix3f::Identity());
+  }
+  graph->AddEdge(0, 4, Vector3f(3.6, 0, 0), Matrix3f::Identity());
+}
+
+}  // namespace
+
+TEST(PoseGraph, RelativePose) {
+  const Vector3f from(1, 2, M_PI / 2);
+  const Vector3f to(1, 3, M_PI);
+  ExpectPoseNear(Vector3f(1, 0, M_PI / 2), PoseGraph::RelativePose(from, to));
+  ExpectPoseNear(Vector3f(0, 0, 0), PoseGraph::RelativePose(to, to));
+}
+
+// Exact measurements around a square, with the estimates drifting away from
+// it: the optimum is the square itself.
+TEST(PoseGraph, ClosesSquareLoop) {
+  const vector<Vector3f> truth = {Vector3f(0, 0, 0),
+                                  Vector3f(2, 0, M_PI / 2),
+                                  Vector3f(2, 2, M_PI),
+                                  Vector3f(0, 2, -M_PI / 2)};
+  PoseGraph graph;
+  for (size_t i = 0; i < truth.size(); ++i) {
+    graph.AddNode(truth[i] + i * Vector3f(0.1, -0.15, 0.05));
+  }
+  Matrix3f information = Matrix3f::Identity();
+  information(2, 2) = 10;
+  for (size_t i = 0; i < truth.size(); ++i) {
+    const size_t j = (i + 1) % truth.size();
+    graph.AddEdge(i, j, PoseGraph::RelativePose(truth[i], truth[j]),
+                  information);
+  }
+  EXPECT_EQ(4u, graph.NumNodes());
+  EXPECT_EQ(4u, graph.NumEdges());
+
+  ASSERT_TRUE(graph.Optimize(0, 20));
+  for (size_t i = 0; i < truth.size(); ++i) {
+    ExpectPoseNear(truth[i], graph.GetNode(i));
+  }
+}
+
+// The 0.4 m loop closure error is shared equally by the five edges.
+TEST(PoseGraph, SpreadsLoopClosureError) {
+  PoseGraph graph;
+  AddChain(&graph);
+  ASSERT_TRUE(graph.Optimize(0, 20));
+  for (int i = 0; i <= 4; ++i) {
+    ExpectPoseNear(Vector3f(0.92 * i, 0, 0), graph.GetNode(i));
+  }
+}
+
+// With nodes 0 and 1 held fixed, the error is shared by the four edges that
+// reach the window.
+TEST(PoseGraph, OptimizesOnlyTheWindow) {
+  PoseGraph graph;
+  AddChain(&graph);
+  ASSERT_TRUE(graph.Optimize(2, 20));
+  ExpectPoseNear(Vector3f(0, 0, 0), graph.GetNode(0));
+  ExpectPoseNear(Vector3f(1, 0, 0), graph.GetNode(1));
+  ExpectPoseNear(Vector3f(1.9, 0, 0), graph.GetNode(2));
+  ExpectPoseNear(Vector3f(2.8, 0, 0), graph.GetNode(3));
+  ExpectPoseNear(Vector3f(3.7, 0, 0), graph.GetNode(4));
+}
+
+TEST(PoseGraph, LeavesUnconstrainedWindowUnchanged) {
+  PoseGraph graph;
+  AddChain(&graph);
+  EXPECT_FALSE(graph.Optimize(5, 20));
+  graph.AddNode(Vector3f(7, 1, 0.5));
+  EXPECT_FALSE(graph.Optimize(5, 20));
+  ExpectPoseNear(Vector3f(7, 1, 0.5), graph.GetNode(5));
+  ExpectPoseNear(Vector3f(4, 0, 0), graph.GetNode(4));
+
+  graph.Clear();
+  EXPECT_EQ(0u, graph.NumNodes());
+  EXPECT_EQ(0u, graph.NumEdges());
+}
@@ -0,0 +1,115 @@
+// This software is free: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License Version 3,
+// as published by the Free Software Foundation.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// Version 3 in the file COPYING that came with this distribution.
+// If not, see <http://www.gnu.org/licenses/>.
+// ========================================================================
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "shared/util/random.h"
+#include "slam/scan_descriptor.h"
+
+using slam::ScanDescriptorIndex;
+using std::pair;
+using std::vector;
+
+namespace {
+
+// 32 bins over 16 m, two per meter.
+const float kMaxRange = 16;
+const float kRangeMin = 0.02;
+const float kRangeMax = 10;
+
+vector<float> ConstantScan(float range, int n) {
+  return vector<float>(n, range);
+}
+
+vector<float> RandomScan(util_random::Random* rng) {
+  vector<float> ranges;
+  // Some readings are outside the limits of the sensor.
+  for (int i = 0; i < 200; ++i) ranges.push_back(rng->UniformRandom(0, 11));
+  return ranges;
+}
+
+}  // namespace
+
+TEST(ScanDescriptor, Distance) {
+  ScanDescriptorIndex index(kMaxRange);
+  // All readings in bin 2, and in bin 5.
+  EXPECT_EQ(0, index.Add(ConstantScan(1.2, 100), kRangeMin, kRangeMax));
+  EXPECT_EQ(1, index.Add(ConstantScan(2.7, 100), kRangeMin, kRangeMax));
+  // Half in each, which is 128 in each bin after rounding.
+  vector<float> mixed = ConstantScan(1.2, 50);
+  mixed.insert(mixed.end(), 50, 2.7);
+  EXPECT_EQ(2, index.Add(mixed, kRangeMin, kRangeMax));
+  // The same histogram in another order, and with readings at and beyond
+  // the limits of the sensor, which are left out.
+  std::reverse(mixed.begin(), mixed.end());
+  mixed.insert(mixed.end(), 30, kRangeMax);
+  mixed.insert(mixed.end(), 20, 0.01);
+  EXPECT_EQ(3, index.Add(mixed, kRangeMin, kRangeMax));
+  EXPECT_EQ(4u, index.Size());
+
+  EXPECT_EQ(0, index.Distance(0, 0));
+  EXPECT_EQ(510, index.Distance(0, 1));
+  EXPECT_EQ(510, index.Distance(1, 0));
+  EXPECT_EQ((255 - 128) + 128, index.Distance(0, 2));
+  EXPECT_EQ(128 + (255 - 128), index.Distance(1, 2));
+  EXPECT_EQ(0, index.Distance(2, 3));
+
+  // A scan without valid readings has an all zero descriptor.
+  EXPECT_EQ(4, index.Add(ConstantScan(kRangeMax, 10), kRangeMin, kRangeMax));
+  EXPECT_EQ(255, index.Distance(0, 4));
+
+  index.Clear();
+  EXPECT_EQ(0u, index.Size());
+  EXPECT_EQ(0, index.Add(ConstantScan(2.7, 10), kRangeMin, kRangeMax));
+}
+
+TEST(ScanDescriptor, SearchMatchesSortedDistances) {
+  util_random::Random rng(1);
+  ScanDescriptorIndex index(kMaxRange);
+  for (int i = 0; i < 300; ++i) {
+    index.Add(RandomScan(&rng), kRangeMin, kRangeMax);
+  }
+  // Repeats, so that there are ties to order by index.
+  for (int i = 0; i < 20; ++i) {
+    index.Add(ConstantScan(3.3, 50), kRangeMin, kRangeMax);
+  }
+  const int size = index.Size();
+
+  vector<pair<int, int> > neighbors;
+  for (const int i : {0, 17, 299, 310}) {
+    for (const int num_searched : {0, 1, 150, size, size + 5}) {
+      vector<pair<int, int> > expected;
+      for (int j = 0; j < std::min(num_searched, size); ++j) {
+        expected.push_back(std::make_pair(index.Distance(i, j), j));
+      }
+      std::sort(expected.begin(), expected.end());
+      for (const int k : {0, 1, 5, 25, 400}) {
+        index.Search(i, num_searched, k, &neighbors);
+        const vector<pair<int, int> > top_k(
+            expected.begin(),
+            expected.begin() + std::min<size_t>(k, expected.size()));
+        EXPECT_EQ(top_k, neighbors)
+            << "i " << i << " num_searched " << num_searched << " k " << k;
+      }
+    }
+  }
+  // A descriptor is closest to itself.
+  index.Search(17, size, 1, &neighbors);
+  ASSERT_EQ(1u, neighbors.size());
+  EXPECT_EQ(std::make_pair(0, 17), neighbors[0]);
+}
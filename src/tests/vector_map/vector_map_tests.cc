@@ -0,0 +1,198 @@
+// This software is free: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License Version 3,
+// as published by the Free Software Foundation.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// Version 3 in the file COPYING that came with this distribution.
+// If not, see <http://www.gnu.org/licenses/>.
+// ========================================================================
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include "eigen3/Eigen/Dense"
+#include "gflags/gflags.h"
+
+#include "shared/math/line2d.h"
+#include "shared/util/random.h"
+#include "vector_map/vector_map.h"
+
+DECLARE_double(map_index_cell_size);
+
+using Eigen::Vector2f;
+using geometry::line2f;
+using std::vector;
+using vector_map::VectorMap;
+
+namespace {
+
+Vector2f RandomPoint(util_random::Random* rng, float size) {
+  return Vector2f(rng->UniformRandom(-size, size),
+                  rng->UniformRandom(-size, size));
+}
+
+// Random walls up to 4 m long, and some axis-aligned ones, which lie along
+// cell boundaries of the index more often.
+vector<line2f> RandomLines(util_random::Random* rng, int n) {
+  vector<line2f> lines;
+  for (int i = 0; i < n; ++i) {
+    const Vector2f p0 = RandomPoint(rng, 10);
+    Vector2f p1 = p0 + RandomPoint(rng, 2);
+    if (i % 4 == 0) p1.x() = p0.x();
+    if (i % 4 == 1) p1.y() = p0.y();
+    lines.push_back(line2f(p0, p1));
+  }
+  return lines;
+}
+
+// Segments starting anywhere around the map, some of them leaving it.
+line2f RandomSegment(util_random::Random* rng, int i) {
+  const Vector2f v0 = RandomPoint(rng, 12);
+  Vector2f v1 = v0 + RandomPoint(rng, (i % 2 == 0) ? 3 : 20);
+  if (i % 10 == 0) v1.x() = v0.x();
+  if (i % 10 == 1) v1.y() = v0.y();
+  if (i % 50 == 2) v1 = v0;
+  return line2f(v0, v1);
+}
+
+// The linear scans that the index replaces.
+bool LinearIntersects(const vector<line2f>& lines, const line2f& s) {
+  for (const line2f& l : lines) {
+    if (l.Intersects(s.p0, s.p1)) return true;
+  }
+  return false;
+}
+
+bool LinearIntersection(const vector<line2f>& lines,
+                        const line2f& s,
+                        Vector2f* intersection) {
+  float closest_sq_dist = std::numeric_limits<float>::infinity();
+  Vector2f p(0, 0);
+  for (const line2f& l : lines) {
+    if (l.Intersection(s.p0, s.p1, &p) &&
+        (p - s.p0).squaredNorm() < closest_sq_dist) {
+      closest_sq_dist = (p - s.p0).squaredNorm();
+      *intersection = p;
+    }
+  }
+  return closest_sq_dist < std::numeric_limits<float>::infinity();
+}
+
+// Whether any part of the line lies inside the box: an end point inside it,
+// or a crossing of one of its sides.
+bool LineTouchesBox(const line2f& l,
+                    const Vector2f& box_min,
+                    const Vector2f& box_max) {
+  auto inside = [&](const Vector2f& p) {
+    return (p.array() >= box_min.array()).all() &&
+        (p.array() <= box_max.array()).all();
+  };
+  if (inside(l.p0) || inside(l.p1)) return true;
+  const Vector2f corners[4] = {box_min,
+                               Vector2f(box_max.x(), box_min.y()),
+                               box_max,
+                               Vector2f(box_min.x(), box_max.y())};
+  for (int i = 0; i < 4; ++i) {
+    if (l.Intersects(corners[i], corners[(i + 1) % 4])) return true;
+  }
+  return false;
+}
+
+void ExpectMatchesLinearScan(const VectorMap& map, util_random::Random* rng) {
+  const vector<line2f>& lines = map.lines();
+  for (int i = 0; i < 2000; ++i) {
+    const line2f s = RandomSegment(rng, i);
+    EXPECT_EQ(LinearIntersects(lines, s), map.Intersects(s.p0, s.p1));
+    Vector2f expected(0, 0);
+    Vector2f actual(0, 0);
+    const bool hit = LinearIntersection(lines, s, &expected);
+    ASSERT_EQ(hit, map.Intersection(s.p0, s.p1, &actual));
+    if (hit) {
+      // The same point, unless two lines are hit at the same distance.
+      EXPECT_NEAR((expected - s.p0).norm(), (actual - s.p0).norm(), 1e-5);
+    }
+  }
+  for (int i = 0; i < 200; ++i) {
+    const Vector2f loc = RandomPoint(rng, 12);
+    const float range = rng->UniformRandom(0.5, 8);
+    vector<line2f> scene;
+    map.GetSceneLines(loc, range, &scene);
+    const Vector2f box(range, range);
+    vector<line2f> expected;
+    for (const line2f& l : lines) {
+      if (LineTouchesBox(l, loc - box, loc + box)) expected.push_back(l);
+    }
+    ASSERT_EQ(expected.size(), scene.size());
+    for (size_t j = 0; j < scene.size(); ++j) {
+      EXPECT_EQ(expected[j].p0, scene[j].p0);
+      EXPECT_EQ(expected[j].p1, scene[j].p1);
+    }
+  }
+}
+
+}  // namespace
+
+TEST(VectorMap, IndexMatchesLinearScan) {
+  util_random::Random rng(1);
+  const float cell_size = FLAGS_map_index_cell_size;
+  for (const float size : {1.0f, 0.37f, 5.0f}) {
+    FLAGS_map_index_cell_size = size;
+    const VectorMap map(RandomLines(&rng, 300));
+    ExpectMatchesLinearScan(map, &rng);
+  }
+  FLAGS_map_index_cell_size = cell_size;
+}
+
+TEST(VectorMap, SetLinesRebuildsIndex) {
+  util_random::Random rng(2);
+  VectorMap map(RandomLines(&rng, 100));
+  // Same number of lines in different places.
+  map.SetLines(RandomLines(&rng, 100));
+  ExpectMatchesLinearScan(map, &rng);
+  map.SetLines(vector<line2f>());
+  EXPECT_FALSE(map.Intersects(Vector2f(-20, -20), Vector2f(20, 20)));
+}
+
+// With one cell over the whole map, the index lists every line in map order,
+// which is what the linear scan rendered.
+TEST(VectorMap, PredictedScansMatchLinearScan) {
+  util_random::Random rng(3);
+  const vector<line2f> lines = RandomLines(&rng, 300);
+  const float cell_size = FLAGS_map_index_cell_size;
+  VectorMap indexed(lines);
+  FLAGS_map_index_cell_size = 1000;
+  VectorMap linear(lines);
+  FLAGS_map_index_cell_size = cell_size;
+
+  const int kNumRays = 181;
+  vector<Vector2f> locs;
+  vector<float> angles;
+  vector<float> expected;
+  vector<float> actual;
+  for (int i = 0; i < 50; ++i) {
+    locs.push_back(RandomPoint(&rng, 10));
+    angles.push_back(rng.UniformRandom(-M_PI, M_PI));
+    linear.GetPredictedScan(locs[i], 0.02, 5, angles[i] - 2.25,
+                            angles[i] + 2.25, kNumRays, &expected);
+    indexed.GetPredictedScan(locs[i], 0.02, 5, angles[i] - 2.25,
+                             angles[i] + 2.25, kNumRays, &actual);
+    EXPECT_EQ(expected, actual);
+  }
+  vector<float> scans;
+  indexed.GetPredictedScans(locs.data(), angles.data(), locs.size(), 0.02, 5,
+                            -2.25, 2.25, kNumRays, &scans);
+  for (size_t i = 0; i < locs.size(); ++i) {
+    linear.GetPredictedScan(locs[i], 0.02, 5, angles[i] - 2.25,
+                            angles[i] + 2.25, kNumRays, &expected);
+    EXPECT_TRUE(std::equal(expected.begin(), expected.end(),
+                           scans.begin() + i * kNumRays));
+  }
+}
@@ -22,6 +22,8 @@
 #include "stdio.h"
 
 #include <algorithm>
+#include <cmath>
+#include <limits>
 #include <utility>
 #include <vector>
 
@@ -54,9 +56,128 @@ using std::swap;
 DEFINE_double(min_line_length,
               0.05,
               "Minimum line length to consider for Analytic ray casting");
+DEFINE_double(map_index_cell_size,
+              1.0,
+              "Cell size (meters) of the spatial index of map lines");
+DEFINE_double(scene_cluster_size,
+              1.0,
+              "Poses in the same cell of this size (meters) share scene "
+              "culling in GetPredictedScans");
+
+namespace {
+// Maximum number of lines, including those split by occlusion, to render.
+const unsigned int kMaxSceneLines = 2000;
+
+// Returns true if any part of the line lies inside the box. Lines that only
+// share a bounding box with it are left out: they lie beyond the range that
+// the box was drawn around, so they can not change a scan.
+bool LineOverlapsBox(const line2f& l,
+                     const Vector2f& box_min,
+                     const Vector2f& box_max) {
+  if (l.p0.x() < box_min.x() && l.p1.x() < box_min.x()) return false;
+  if (l.p0.y() < box_min.y() && l.p1.y() < box_min.y()) return false;
+  if (l.p0.x() > box_max.x() && l.p1.x() > box_max.x()) return false;
+  if (l.p0.y() > box_max.y() && l.p1.y() > box_max.y()) return false;
+  float t0 = 0;
+  float t1 = 1;
+  return vector_map::LineGrid::ClipSegment(l.p0, l.p1 - l.p0, box_min, box_max,
+                                           &t0, &t1);
+}
+}  // namespace
 
 namespace vector_map {
 
+void LineGrid::Build(const vector<line2f>& lines, float cell_size) {
+  // Lines are added to every cell that they come within kPadding of, so that
+  // queries along cell boundaries and through cell corners are conservative.
+  static const float kPadding = 1e-4;
+  num_lines_ = lines.size();
+  cell_size_ = cell_size;
+  inv_cell_size_ = 1.0 / cell_size;
+  width_ = 0;
+  height_ = 0;
+  cell_start_.assign(1, 0);
+  cell_lines_.clear();
+  if (lines.empty()) return;
+
+  Vector2f p_min(std::numeric_limits<float>::max(),
+                 std::numeric_limits<float>::max());
+  Vector2f p_max = -p_min;
+  for (const line2f& l : lines) {
+    p_min = p_min.cwiseMin(l.p0).cwiseMin(l.p1);
+    p_max = p_max.cwiseMax(l.p0).cwiseMax(l.p1);
+  }
+  origin_ = p_min - Vector2f(kPadding, kPadding);
+  width_ = static_cast<int>((p_max.x() - origin_.x()) * inv_cell_size_) + 1;
+  height_ = static_cast<int>((p_max.y() - origin_.y()) * inv_cell_size_) + 1;
+
+  vector<vector<int> > cells(width_ * height_);
+  for (size_t i = 0; i < lines.size(); ++i) {
+    const line2f& l = lines[i];
+    const Vector2f l_min = l.p0.cwiseMin(l.p1);
+    const Vector2f l_max = l.p0.cwiseMax(l.p1);
+    const int x0 = std::max(0, static_cast<int>(
+        (l_min.x() - kPadding - origin_.x()) * inv_cell_size_));
+    const int y0 = std::max(0, static_cast<int>(
+        (l_min.y() - kPadding - origin_.y()) * inv_cell_size_));
+    const int x1 = std::min(width_ - 1, static_cast<int>(
+        (l_max.x() + kPadding - origin_.x()) * inv_cell_size_));
+    const int y1 = std::min(height_ - 1, static_cast<int>(
+        (l_max.y() + kPadding - origin_.y()) * inv_cell_size_));
+    for (int y = y0; y <= y1; ++y) {
+      for (int x = x0; x <= x1; ++x) {
+        const Vector2f cell_min =
+            origin_ + cell_size_ * Vector2f(x, y) - Vector2f(kPadding, kPadding);
+        const Vector2f cell_max =
+            cell_min + Vector2f(cell_size_, cell_size_) +
+            Vector2f(2 * kPadding, 2 * kPadding);
+        float t0 = 0;
+        float t1 = 1;
+        if (ClipSegment(l.p0, l.p1 - l.p0, cell_min, cell_max, &t0, &t1)) {
+          cells[y * width_ + x].push_back(i);
+        }
+      }
+    }
+  }
+
+  // Flatten into a compressed row layout.
+  cell_start_.resize(cells.size() + 1);
+  cell_start_[0] = 0;
+  for (size_t i = 0; i < cells.size(); ++i) {
+    cell_start_[i + 1] = cell_start_[i] + cells[i].size();
+  }
+  cell_lines_.reserve(cell_start_.back());
+  for (const vector<int>& cell : cells) {
+    cell_lines_.insert(cell_lines_.end(), cell.begin(), cell.end());
+  }
+}
+
+void LineGrid::GetLinesInBox(const Vector2f& box_min,
+                             const Vector2f& box_max,
+                             vector<int>* line_ids) const {
+  line_ids->clear();
+  if (width_ == 0 || height_ == 0) return;
+  const int x0 = std::max(0, static_cast<int>(
+      std::floor((box_min.x() - origin_.x()) * inv_cell_size_)));
+  const int y0 = std::max(0, static_cast<int>(
+      std::floor((box_min.y() - origin_.y()) * inv_cell_size_)));
+  const int x1 = std::min(width_ - 1, static_cast<int>(
+      std::floor((box_max.x() - origin_.x()) * inv_cell_size_)));
+  const int y1 = std::min(height_ - 1, static_cast<int>(
+      std::floor((box_max.y() - origin_.y()) * inv_cell_size_)));
+  for (int y = y0; y <= y1; ++y) {
+    for (int x = x0; x <= x1; ++x) {
+      const int cell = y * width_ + x;
+      line_ids->insert(line_ids->end(),
+                       cell_lines_.begin() + cell_start_[cell],
+                       cell_lines_.begin() + cell_start_[cell + 1]);
+    }
+  }
+  std::sort(line_ids->begin(), line_ids->end());
+  line_ids->erase(std::unique(line_ids->begin(), line_ids->end()),
+                  line_ids->end());
+}
+
 void TrimOcclusion(const Vector2f& loc,
                    const line2f& test_line,
                    line2f* trim_line_ptr,
@@ -197,17 +318,21 @@ void TrimOcclusion(const Vector2f& loc,
 void VectorMap::GetSceneLines(const Vector2f& loc,
                               float max_range,
                               vector<line2f>* lines_list) const {
-  const float x_min = loc.x() - max_range;
-  const float y_min = loc.y() - max_range;
-  const float x_max = loc.x() + max_range;
-  const float y_max = loc.y() + max_range;
+  const Vector2f range(max_range, max_range);
+  GetLinesInBox(loc - range, loc + range, lines_list);
+}
+
+void VectorMap::GetLinesInBox(const Vector2f& box_min,
+                              const Vector2f& box_max,
+                              vector<line2f>* lines_list) const {
   lines_list->clear();
-  for (const line2f& l : lines) {
-    if (l.p0.x() < x_min && l.p1.x() < x_min) continue;
-    if (l.p0.y() < y_min && l.p1.y() < y_min) continue;
-    if (l.p0.x() > x_max && l.p1.x() > x_max) continue;
-    if (l.p0.y() > y_max && l.p1.y() > y_max) continue;
-    lines_list->push_back(l);
+  // The test of a linear scan, on the candidates from the index, which are in
+  // increasing order, so the result is identical to the linear scan.
+  vector<int> line_ids;
+  line_grid_.GetLinesInBox(box_min, box_max, &line_ids);
+  for (const int i : line_ids) {
+    const line2f& l = lines_[i];
+    if (LineOverlapsBox(l, box_min, box_max)) lines_list->push_back(l);
   }
 }
 
@@ -216,14 +341,28 @@ void VectorMap::SceneRender(const Vector2f& loc,
                             float angle_min,
                             float angle_max,
                             vector<line2f>* render) const {
-  static const unsigned int MaxLines = 2000;
-  const float eps = Sq(FLAGS_min_line_length);
-  vector<line2f> scene;
   vector<line2f> lines_list;
   GetSceneLines(loc, max_range, &lines_list);
+  RenderLines(loc, &lines_list, render);
+
+  if (lines_list.size() >= kMaxSceneLines) {
+    fprintf(stderr,
+            "Runaway Analytic Scene Render at %.30f,%.30f, %.3f : %.3f\u00b0\n",
+            loc.x(), loc.y(),
+            RadToDeg(angle_min),
+            RadToDeg(angle_max));
+  }
+}
+
+void VectorMap::RenderLines(const Vector2f& loc,
+                            vector<line2f>* lines_list_ptr,
+                            vector<line2f>* render) {
+  vector<line2f>& lines_list = *lines_list_ptr;
+  const float eps = Sq(FLAGS_min_line_length);
+  vector<line2f> scene;
   render->clear();
 
-  for(size_t i = 0; i < lines_list.size() && i < MaxLines; ++i) {
+  for(size_t i = 0; i < lines_list.size() && i < kMaxSceneLines; ++i) {
     line2f cur_line = lines_list[i];
     // Check if any part of cur_line is unoccluded by present list of lines,
     // as seen from loc.
@@ -242,13 +381,6 @@ void VectorMap::SceneRender(const Vector2f& loc,
     }
   }
 
-  if (lines_list.size() >= MaxLines) {
-    fprintf(stderr,
-            "Runaway Analytic Scene Render at %.30f,%.30f, %.3f : %.3f\u00b0\n",
-            loc.x(), loc.y(),
-            RadToDeg(angle_min),
-            RadToDeg(angle_max));
-  }
   for(const line2f& l : scene) {
     if (l.SqLength() > eps) render->push_back(l);
   }
@@ -342,8 +474,8 @@ void VectorMap::Cleanup() {
   // const float kMinLineLength = 2.0 * kShrinkDistance;
   const float kMinLineLength = 0.05;
   vector<line2f> new_lines;
-  for (size_t i = 0; i < lines.size(); ++i) {
-    const line2f& l1 = lines[i];
+  for (size_t i = 0; i < lines_.size(); ++i) {
+    const line2f& l1 = lines_[i];
     if (l1.Length() < kMinLineLength) continue;
     // Check if l1 intersects with any line in new lines.
     Vector2f p;
@@ -353,8 +485,8 @@ void VectorMap::Cleanup() {
         const Vector2f shrink = kShrinkDistance * l1.Dir();
         const line2f a = line2f(l1.p0, p - shrink);
         const line2f b = line2f(p + shrink, l1.p1);
-        lines.push_back(a);
-        lines.push_back(b);
+        lines_.push_back(a);
+        lines_.push_back(b);
         intersection = true;
         break;
       }
@@ -366,7 +498,8 @@ void VectorMap::Cleanup() {
   for (line2f& l : new_lines) {
     ShrinkLine(kShrinkDistance, &l);
   }
-  lines = new_lines;
+  lines_ = new_lines;
+  BuildIndex();
 }
 
 void VectorMap::Load(const string& file) {
@@ -375,21 +508,60 @@ void VectorMap::Load(const string& file) {
     fprintf(stderr, "ERROR: Unable to load map %s\n", file.c_str());
     exit(1);
   }
-  lines.clear();
+  lines_.clear();
   float x1(0), y1(0), x2(0), y2(0);
   while (fscanf(fid, "%f,%f,%f,%f", &x1, &y1, &x2, &y2) == 4) {
-    lines.push_back(line2f(Vector2f(x1, y1), Vector2f(x2, y2)));
+    lines_.push_back(line2f(Vector2f(x1, y1), Vector2f(x2, y2)));
   }
   fclose(fid);
   Cleanup();
   file_name = file;
 }
 
+void VectorMap::SetLines(const vector<line2f>& lines) {
+  lines_ = lines;
+  BuildIndex();
+}
+
+void VectorMap::BuildIndex() {
+  line_grid_.Build(lines_, FLAGS_map_index_cell_size);
+}
+
 bool VectorMap::Intersects(const Vector2f& v0, const Vector2f& v1) const {
-  for (const line2f& l : lines) {
-    if (l.Intersects(v0, v1)) return true;
-  }
-  return false;
+  bool intersects = false;
+  line_grid_.WalkSegment(v0, v1, [&](const int* begin, const int* end, float) {
+    for (const int* i = begin; i < end; ++i) {
+      if (lines_[*i].Intersects(v0, v1)) {
+        intersects = true;
+        return true;
+      }
+    }
+    return false;
+  });
+  return intersects;
+}
+
+bool VectorMap::Intersection(const Vector2f& v0,
+                             const Vector2f& v1,
+                             Vector2f* intersection) const {
+  const float length = (v1 - v0).norm();
+  float closest_sq_dist = std::numeric_limits<float>::infinity();
+  Vector2f p(0, 0);
+  auto test_line = [&](const line2f& l) {
+    if (l.Intersection(v0, v1, &p) &&
+        (p - v0).squaredNorm() < closest_sq_dist) {
+      closest_sq_dist = (p - v0).squaredNorm();
+      *intersection = p;
+    }
+  };
+  line_grid_.WalkSegment(v0, v1,
+                         [&](const int* begin, const int* end, float t_exit) {
+    for (const int* i = begin; i < end; ++i) test_line(lines_[*i]);
+    // A hit inside the cells walked so far is closer than anything in the
+    // cells that follow.
+    return closest_sq_dist <= Sq(t_exit * length);
+  });
+  return closest_sq_dist < std::numeric_limits<float>::infinity();
 }
 
 void VectorMap::GetPredictedScan(const Vector2f& loc,
@@ -405,7 +577,93 @@ void VectorMap::GetPredictedScan(const Vector2f& loc,
   vector<line2f> raycast;
   SceneRender(loc, range_max, angle_min, angle_max, &raycast);
   scan.resize(num_rays);
-  std::fill(scan.begin(), scan.end(), range_max);
+  FillScan(loc, raycast, range_max, angle_min, angle_max, num_rays, scan.data());
+}
+
+void VectorMap::GetPredictedScans(const Vector2f* locs,
+                                  const float* angles,
+                                  size_t num_poses,
+                                  float range_min,
+                                  float range_max,
+                                  float angle_min,
+                                  float angle_max,
+                                  int num_rays,
+                                  vector<float>* scans_ptr) const {
+  static CumulativeFunctionTimer function_timer_(__FUNCTION__);
+  CumulativeFunctionTimer::Invocation invoke(&function_timer_);
+  vector<float>& scans = *scans_ptr;
+  scans.resize(num_poses * num_rays);
+  if (num_poses == 0 || num_rays <= 0) return;
+
+  // Group the poses by the cell of side scene_cluster_size that they lie in.
+  // Each cluster queries the map once for the lines near any of its poses.
+  const float cluster_size = std::max<float>(1e-3, FLAGS_scene_cluster_size);
+  vector<std::pair<int64_t, size_t> > cells(num_poses);
+  for (size_t i = 0; i < num_poses; ++i) {
+    const int64_t cx = static_cast<int64_t>(floor(locs[i].x() / cluster_size));
+    const int64_t cy = static_cast<int64_t>(floor(locs[i].y() / cluster_size));
+    cells[i] = std::make_pair((cx << 32) ^ (cy & 0xFFFFFFFF), i);
+  }
+  std::sort(cells.begin(), cells.end());
+  vector<size_t> cluster_start;
+  for (size_t i = 0; i < num_poses; ++i) {
+    if (i == 0 || cells[i].first != cells[i - 1].first) {
+      cluster_start.push_back(i);
+    }
+  }
+  cluster_start.push_back(num_poses);
+  const int num_clusters = static_cast<int>(cluster_start.size()) - 1;
+
+  const Vector2f range(range_max, range_max);
+#ifdef _OPENMP
+  #pragma omp parallel
+#endif
+  {
+    vector<line2f> cluster_lines;
+    vector<line2f> lines_list;
+    vector<line2f> raycast;
+#ifdef _OPENMP
+    #pragma omp for schedule(dynamic)
+#endif
+    for (int c = 0; c < num_clusters; ++c) {
+      Vector2f box_min = locs[cells[cluster_start[c]].second];
+      Vector2f box_max = box_min;
+      for (size_t j = cluster_start[c]; j < cluster_start[c + 1]; ++j) {
+        box_min = box_min.cwiseMin(locs[cells[j].second]);
+        box_max = box_max.cwiseMax(locs[cells[j].second]);
+      }
+      GetLinesInBox(box_min - range, box_max + range, &cluster_lines);
+      for (size_t j = cluster_start[c]; j < cluster_start[c + 1]; ++j) {
+        const size_t i = cells[j].second;
+        // The lines near this pose, in the same order as GetSceneLines, so
+        // that the scan matches GetPredictedScan exactly.
+        lines_list.clear();
+        for (const line2f& l : cluster_lines) {
+          if (LineOverlapsBox(l, locs[i] - range, locs[i] + range)) {
+            lines_list.push_back(l);
+          }
+        }
+        RenderLines(locs[i], &lines_list, &raycast);
+        FillScan(locs[i],
+                 raycast,
+                 range_max,
+                 angles[i] + angle_min,
+                 angles[i] + angle_max,
+                 num_rays,
+                 &scans[i * num_rays]);
+      }
+    }
+  }
+}
+
+void VectorMap::FillScan(const Vector2f& loc,
+                         const vector<line2f>& raycast,
+                         float range_max,
+                         float angle_min,
+                         float angle_max,
+                         int num_rays,
+                         float* scan) {
+  std::fill(scan, scan + num_rays, range_max);
   if (raycast.empty()) {
     return;
   }
@@ -436,7 +694,6 @@ void VectorMap::GetPredictedScan(const Vector2f& loc,
     return;
   }
   // Iterate over the ray cast, filling the angles
-  scan.resize(num_rays);
   const float da = (angle_max - angle_min) / static_cast<float>(num_rays);
   for (int i = 0; i < num_rays; ++i) {
     const float a = AngleMod(angle_min + static_cast<float>(i) * da);
@@ -19,6 +19,9 @@
 */
 //========================================================================
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
 #include <string>
 #include <vector>
 
@@ -38,10 +41,130 @@ void TrimOcclusion(const Eigen::Vector2f& loc,
                   geometry::line2f* line2_ptr,
                   std::vector<geometry::line2f>* scene_lines_ptr);
 
+// Uniform grid over the bounding box of a set of lines, where every cell lists
+// the lines passing through it. Queries only visit the cells that they touch,
+// walking along segments cell by cell (Amanatides and Woo's DDA).
+class LineGrid {
+ public:
+  LineGrid() :
+      origin_(0, 0),
+      cell_size_(1),
+      inv_cell_size_(1),
+      width_(0),
+      height_(0),
+      num_lines_(0) {}
+
+  void Build(const std::vector<geometry::line2f>& lines, float cell_size);
+
+  // Number of lines that the grid was built from.
+  size_t NumLines() const { return num_lines_; }
+
+  // Indices of all lines in cells overlapping the box, in increasing order.
+  void GetLinesInBox(const Eigen::Vector2f& box_min,
+                     const Eigen::Vector2f& box_max,
+                     std::vector<int>* line_ids) const;
+
+  // Visit the cells crossed by the segment from v0 to v1, in order. For each
+  // cell, calls visit(begin, end, t_exit), where [begin, end) are the indices
+  // of the lines in the cell and t_exit is the fraction of the segment at
+  // which it leaves the cell. The walk stops early if visit returns true.
+  // A line may be reported by more than one cell.
+  template <typename Visitor>
+  void WalkSegment(const Eigen::Vector2f& v0,
+                   const Eigen::Vector2f& v1,
+                   Visitor visit) const {
+    if (width_ == 0 || height_ == 0) return;
+    const Eigen::Vector2f d = v1 - v0;
+    const Eigen::Vector2f grid_max =
+        origin_ + cell_size_ * Eigen::Vector2f(width_, height_);
+    float t_start = 0;
+    float t_end = 1;
+    if (!ClipSegment(v0, d, origin_, grid_max, &t_start, &t_end)) return;
+    const Eigen::Vector2f p = v0 + t_start * d;
+    int x = std::min(width_ - 1, std::max(0, static_cast<int>(
+        (p.x() - origin_.x()) * inv_cell_size_)));
+    int y = std::min(height_ - 1, std::max(0, static_cast<int>(
+        (p.y() - origin_.y()) * inv_cell_size_)));
+    const float kInf = std::numeric_limits<float>::infinity();
+    const int step_x = (d.x() > 0) ? 1 : ((d.x() < 0) ? -1 : 0);
+    const int step_y = (d.y() > 0) ? 1 : ((d.y() < 0) ? -1 : 0);
+    const float t_delta_x = (step_x == 0) ? kInf : cell_size_ / std::fabs(d.x());
+    const float t_delta_y = (step_y == 0) ? kInf : cell_size_ / std::fabs(d.y());
+    // Fraction of the segment at which it crosses the next cell boundary.
+    float t_max_x = kInf;
+    float t_max_y = kInf;
+    if (step_x != 0) {
+      const float boundary = origin_.x() + cell_size_ * (x + (step_x > 0));
+      t_max_x = (boundary - v0.x()) / d.x();
+    }
+    if (step_y != 0) {
+      const float boundary = origin_.y() + cell_size_ * (y + (step_y > 0));
+      t_max_y = (boundary - v0.y()) / d.y();
+    }
+    while (true) {
+      const int cell = y * width_ + x;
+      const float t_exit = std::min(t_end, std::min(t_max_x, t_max_y));
+      if (visit(&cell_lines_[cell_start_[cell]],
+                &cell_lines_[cell_start_[cell + 1]],
+                t_exit)) {
+        return;
+      }
+      if (t_exit >= t_end) return;
+      if (t_max_x < t_max_y) {
+        x += step_x;
+        t_max_x += t_delta_x;
+      } else {
+        y += step_y;
+        t_max_y += t_delta_y;
+      }
+      if (x < 0 || y < 0 || x >= width_ || y >= height_) return;
+    }
+  }
+
+  // Clip the segment p + t * d, t in [*t0, *t1], to an axis-aligned box
+  // (Liang-Barsky). Returns false if the segment misses the box.
+  static bool ClipSegment(const Eigen::Vector2f& p,
+                          const Eigen::Vector2f& d,
+                          const Eigen::Vector2f& box_min,
+                          const Eigen::Vector2f& box_max,
+                          float* t0,
+                          float* t1) {
+    for (int i = 0; i < 2; ++i) {
+      if (d[i] == 0) {
+        if (p[i] < box_min[i] || p[i] > box_max[i]) return false;
+        continue;
+      }
+      float ta = (box_min[i] - p[i]) / d[i];
+      float tb = (box_max[i] - p[i]) / d[i];
+      if (ta > tb) std::swap(ta, tb);
+      *t0 = std::max(*t0, ta);
+      *t1 = std::min(*t1, tb);
+      if (*t0 > *t1) return false;
+    }
+    return true;
+  }
+
+ private:
+  // Location of the lower left corner of cell (0, 0).
+  Eigen::Vector2f origin_;
+  float cell_size_;
+  float inv_cell_size_;
+  // Number of cells along x and y.
+  int width_;
+  int height_;
+  size_t num_lines_;
+  // Lines of cell i are cell_lines_[cell_start_[i]] to
+  // cell_lines_[cell_start_[i + 1] - 1]. Cells are row-major.
+  std::vector<int> cell_start_;
+  std::vector<int> cell_lines_;
+};
+
 struct VectorMap {
   VectorMap() {}
   explicit VectorMap(const std::vector<geometry::line2f>& lines) :
-      lines(lines) {}
+      lines_(lines) {
+    BuildIndex();
+  }
   explicit VectorMap(const std::string& file) {
     Load(file);
   }
@@ -69,13 +192,65 @@ struct VectorMap {
                         float angle_max,
                         int num_rays,
                         std::vector<float>* scan);
+
+  // Get predicted laser scans from many poses at once. Ray angles are
+  // relative to the angle of each pose, and the scan from pose i is written
+  // to (*scans)[i * num_rays] to (*scans)[(i + 1) * num_rays - 1]. Poses that
+  // are close together share the map query for nearby lines, and poses are
+  // rendered in parallel.
+  void GetPredictedScans(const Eigen::Vector2f* locs,
+                         const float* angles,
+                         size_t num_poses,
+                         float range_min,
+                         float range_max,
+                         float angle_min,
+                         float angle_max,
+                         int num_rays,
+                         std::vector<float>* scans) const;
   void Cleanup();
 
   void Load(const std::string& file);
 
+  // Lines of the map. They can only be changed by Load, SetLines and
+  // Cleanup, which rebuild the spatial index of the lines.
+  const std::vector<geometry::line2f>& lines() const { return lines_; }
+  void SetLines(const std::vector<geometry::line2f>& lines);
+
   bool Intersects(const Eigen::Vector2f& v0, const Eigen::Vector2f& v1) const ;
-  std::vector<geometry::line2f> lines;
+
+  // Find the intersection of the segment from v0 to v1 with the map that is
+  // closest to v0. Returns false if the segment does not hit any line.
+  bool Intersection(const Eigen::Vector2f& v0,
+                    const Eigen::Vector2f& v1,
+                    Eigen::Vector2f* intersection) const;
+
   std::string file_name;
+
+ private:
+  void BuildIndex();
+
+  // Lines with any part inside the box, in map order.
+  void GetLinesInBox(const Eigen::Vector2f& box_min,
+                     const Eigen::Vector2f& box_max,
+                     std::vector<geometry::line2f>* lines_list) const;
+
+  // Visible parts of lines_list as seen from loc. Lines split by occlusion
+  // are appended to lines_list.
+  static void RenderLines(const Eigen::Vector2f& loc,
+                          std::vector<geometry::line2f>* lines_list,
+                          std::vector<geometry::line2f>* render);
+
+  // Ranges of num_rays rays from loc to the rendered lines.
+  static void FillScan(const Eigen::Vector2f& loc,
+                       const std::vector<geometry::line2f>& raycast,
+                       float range_max,
+                       float angle_min,
+                       float angle_max,
+                       int num_rays,
+                       float* scan);
+
+  std::vector<geometry::line2f> lines_;
+  LineGrid line_grid_;
 };
 
 